@@ -1,19 +1,331 @@
+#include "malloc.h"
 #include "arena.h"
+#include "freeidx.h"
+#include "quick.h"
 #include "invariants.h"
+#include "hist.h"
 
-static void *get_memory(size_t size) {
+/*
+ * Bytes mapped by malloc & private heaps and soft limit on them, 0 meaning
+ * none. Both are atomic, so they're checked without any lock.
+ */
+size_t arena_mapped = 0;
+size_t arena_limit = 0;
+
+__thread bool arena_limited __initial_exec = false;
+
+/* Counts 'size' bytes about to be mapped, unless that would cross the limit */
+bool arena_reserve(size_t size) {
+  size_t limit = __atomic_load_n(&arena_limit, __ATOMIC_RELAXED);
+  size_t mapped = __atomic_add_fetch(&arena_mapped, size, __ATOMIC_RELAXED);
+
+  if (limit && mapped > limit) {
+    __atomic_sub_fetch(&arena_mapped, size, __ATOMIC_RELAXED);
+    arena_limited = true;
+    return false;
+  }
+
+  return true;
+}
+
+void arena_unreserve(size_t size) {
+  __atomic_sub_fetch(&arena_mapped, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Nodes arenas may be on, 1 without NUMA. It's read at startup, anything
+ * mapped before is on node 0. Nodes past ARENA_NODES_MAX share node 0.
+ */
+uint32_t arena_nodes = 1;
+
+void arena_numa_init(void) {
+  char buf[256];
+  uint32_t node = 0, last = 0;
+  ssize_t len;
+  int fd;
+
+  if ((fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC)) < 0)
+    return;
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+
+  /* ranges like "0-3,8-11", the last number is the highest node */
+  for (ssize_t i = 0; i < len; i++) {
+    if (buf[i] >= '0' && buf[i] <= '9') {
+      node = node * 10 + buf[i] - '0';
+    }
+    else {
+      last = max(last, node);
+      node = 0;
+    }
+  }
+
+  arena_nodes = min(max(last, node) + 1, ARENA_NODES_MAX);
+}
+
+/* Node of CPU calling thread runs on */
+uint32_t arena_node(void) {
+  unsigned cpu, node;
+
+  if (arena_nodes == 1 || getcpu(&cpu, &node) < 0 || node >= arena_nodes)
+    return 0;
+
+  return node;
+}
+
+/*
+ * Binds mapping to 'node'. Policy is preferred rather than strict, so full
+ * node falls back to others instead of failing page faults.
+ */
+static void arena_bind(void *mem, size_t size, uint32_t node) {
+  unsigned long mask[ARENA_NODES_MAX / 64 + 1] = {0};
+
+  mask[node / 64] = 1UL << (node % 64);
+  if (syscall(SYS_mbind, mem, size, MPOL_PREFERRED, mask, ARENA_NODES_MAX + 1,
+              0) < 0)
+    debug("mbind failed with \"%s\"", strerror(errno));
+}
+
+/*
+ * Prefaulting. Mappings up to 'arena_prefault' bytes are populated right
+ * away, so first touches don't page fault. Every node has its warm pool
+ * of up to 'arena_warm_target' populated mappings of ARENA_MAXSIZE bytes,
+ * mapped ahead by background thread, which waits on 'arena_warm_sem' to be
+ * told one was taken. Only pools of nodes arenas were asked for are kept
+ * warm. Pools are counted against heap limit. They aren't trimmed, but are
+ * emptied when the limit is hit, and not refilled too close to it.
+ */
+size_t arena_prefault = 0;
+
+pthread_mutex_t arena_warm_mtx = PTHREAD_MUTEX_INITIALIZER;
+sem_t arena_warm_sem;
+static void *arena_warm[ARENA_NODES_MAX][ARENA_WARM_MAX];
+static size_t arena_nwarm[ARENA_NODES_MAX];
+static size_t arena_warm_target = 0;
+static uint64_t arena_warm_nodes = 0;
+
+/* Marks pool of 'node' as one to keep warm */
+static void arena_warm_want(uint32_t node) {
+  uint64_t bit = 1ULL << node;
+
+  if (!(__atomic_load_n(&arena_warm_nodes, __ATOMIC_RELAXED) & bit)) {
+    __atomic_or_fetch(&arena_warm_nodes, bit, __ATOMIC_RELAXED);
+    sem_post(&arena_warm_sem);
+  }
+}
+
+static void *arena_warm_take(uint32_t node) {
   void *mem = NULL;
 
+  arena_warm_want(node);
+
+  /* pool emptied under heap limit is refilled once there's room again */
+  if (__atomic_load_n(&arena_nwarm[node], __ATOMIC_RELAXED) == 0) {
+    if (__atomic_load_n(&arena_warm_target, __ATOMIC_RELAXED) > 0)
+      sem_post(&arena_warm_sem);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&arena_warm_mtx);
+  if (arena_nwarm[node] > 0)
+    mem = arena_warm[node][--arena_nwarm[node]];
+  pthread_mutex_unlock(&arena_warm_mtx);
+
+  if (mem)
+    sem_post(&arena_warm_sem);
+
+  return mem;
+}
+
+static void *arena_map(size_t size, bool populate, uint32_t node) {
+  bool bind = arena_nodes > 1 && node != ARENA_ANY_NODE;
+  void *mem;
+
+  if (!arena_reserve(size)) {
+    debug("mapping %lu bytes would exceed heap limit", size);
+    return NULL;
+  }
+
+  HIST_BEGIN(start);
   int prot = PROT_READ | PROT_WRITE;
   int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  /* bound mapping is populated only once it's bound */
+  if (populate && !bind)
+    flags |= MAP_POPULATE;
   if ((mem = mmap(NULL, size, prot, flags, -1, 0)) == MAP_FAILED) {
     debug("mmap failed with \"%s\"", strerror(errno));
+    arena_unreserve(size);
     mem = NULL;
   }
+  else if (bind) {
+    arena_bind(mem, size, node);
+    if (populate && madvise(mem, size, MADV_POPULATE_WRITE) < 0)
+      debug("madvise failed with \"%s\"", strerror(errno));
+  }
+  HIST_END(MALLOC_LAT_MMAP, start);
 
   return mem;
 }
 
+/*
+ * Maps one more arena for warm pool that's short of one. Called without
+ * any lock. Returns false when pools are full or mapping failed.
+ */
+bool arena_warm_refill(void) {
+  uint64_t nodes = __atomic_load_n(&arena_warm_nodes, __ATOMIC_RELAXED);
+  size_t limit = __atomic_load_n(&arena_limit, __ATOMIC_RELAXED);
+  uint32_t node;
+  void *mem;
+
+  /* room under heap limit is left to allocations, not taken ahead of them */
+  if (limit
+      && __atomic_load_n(&arena_mapped, __ATOMIC_RELAXED) + ARENA_MAXSIZE > limit)
+    return false;
+
+  pthread_mutex_lock(&arena_warm_mtx);
+  for (node = 0; node < arena_nodes; node++)
+    if ((nodes & (1ULL << node)) && arena_nwarm[node] < arena_warm_target)
+      break;
+  pthread_mutex_unlock(&arena_warm_mtx);
+
+  if (node == arena_nodes
+      || (mem = arena_map(ARENA_MAXSIZE, true, node)) == NULL)
+    return false;
+
+  pthread_mutex_lock(&arena_warm_mtx);
+  bool short_of = arena_nwarm[node] < arena_warm_target;
+  if (short_of)
+    arena_warm[node][arena_nwarm[node]++] = mem;
+  pthread_mutex_unlock(&arena_warm_mtx);
+
+  if (!short_of)
+    put_memory(mem, ARENA_MAXSIZE);
+
+  return short_of;
+}
+
+/* Unmaps arenas of warm pools past 'keep' in each, returns bytes unmapped */
+static size_t arena_warm_shrink(size_t keep) {
+  void *excess[ARENA_WARM_MAX];
+  size_t bytes = 0;
+
+  for (uint32_t node = 0; node < arena_nodes; node++) {
+    size_t n = 0;
+
+    pthread_mutex_lock(&arena_warm_mtx);
+    while (arena_nwarm[node] > keep)
+      excess[n++] = arena_warm[node][--arena_nwarm[node]];
+    pthread_mutex_unlock(&arena_warm_mtx);
+
+    while (n > 0)
+      if (put_memory(excess[--n], ARENA_MAXSIZE) == 0)
+        bytes += ARENA_MAXSIZE;
+  }
+
+  return bytes;
+}
+
+/*
+ * Sets size of warm pools, unmapping arenas they no longer need. Pool of
+ * calling thread's node is kept warm from now on.
+ */
+void arena_warm_resize(size_t target) {
+  pthread_mutex_lock(&arena_warm_mtx);
+  arena_warm_target = min(target, ARENA_WARM_MAX);
+  pthread_mutex_unlock(&arena_warm_mtx);
+
+  arena_warm_shrink(min(target, ARENA_WARM_MAX));
+
+  if (target > 0)
+    arena_warm_want(arena_node());
+  sem_post(&arena_warm_sem);
+}
+
+/* Empties warm pools to make room under heap limit, returns bytes unmapped */
+size_t arena_warm_drain(void) {
+  return arena_warm_shrink(0);
+}
+
+size_t arena_warm_bytes(uint32_t node) {
+  return __atomic_load_n(&arena_nwarm[node], __ATOMIC_RELAXED) * ARENA_MAXSIZE;
+}
+
+/* Maps 'size' bytes on 'node', or anywhere for ARENA_ANY_NODE */
+void *get_memory(size_t size, uint32_t node) {
+  void *mem;
+
+  if (size == ARENA_MAXSIZE && node != ARENA_ANY_NODE
+      && (mem = arena_warm_take(node)))
+    return mem;
+
+  return arena_map(size, size <= __atomic_load_n(&arena_prefault,
+                                                  __ATOMIC_RELAXED), node);
+}
+
+int put_memory(void *mem, size_t size) {
+  int res;
+
+  HIST_BEGIN(start);
+  if ((res = munmap(mem, size)) == 0)
+    arena_unreserve(size);
+  HIST_END(MALLOC_LAT_MUNMAP, start);
+
+  return res;
+}
+
+__thread uint64_t arena_thread_allocated __initial_exec = 0;
+__thread uint64_t arena_thread_deallocated __initial_exec = 0;
+
+/* Purge clock, never 0, so stamp of 0 always means clean arena */
+uint32_t arena_epoch = 1;
+bool arena_purging = false;
+size_t arena_purged_bytes = 0;
+
+/* Owner id of calling thread, ids are never reused */
+static __thread uint32_t arena_self __initial_exec = ARENA_NO_OWNER;
+static uint32_t arena_owners = ARENA_NO_OWNER;
+
+uint32_t arena_owner(void) {
+  if (__unlikely(arena_self == ARENA_NO_OWNER))
+    arena_self = __atomic_add_fetch(&arena_owners, 1, __ATOMIC_RELAXED);
+
+  return arena_self;
+}
+
+/* Owner id calling thread gives to 'arenas', shared ones are never owned */
+static uint32_t arenas_owner(arenas_t arenas) {
+  return arenas.shared ? ARENA_NO_OWNER : arena_owner();
+}
+
+/*
+ * Called when thread exits: flushes quick bins of its arenas, which hold
+ * blocks only it would reuse, and leaves arenas to be adopted. If thread
+ * allocates again, say from another destructor, it gets a new id.
+ */
+void arenas_orphan(arenas_t arenas) {
+  uint32_t self = arena_self;
+  arena_t *arena;
+
+  if (self == ARENA_NO_OWNER)
+    return;
+
+  LIST_FOREACH(arena, arenas.small, link) {
+    if (arena->owner == self) {
+      quick_flush(arena);
+      arena->owner = ARENA_NO_OWNER;
+    }
+  }
+
+  for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++) {
+    LIST_FOREACH(arena, &arenas.aligned[i], link) {
+      if (arena->owner == self)
+        arena->owner = ARENA_NO_OWNER;
+    }
+  }
+
+  arena_self = ARENA_NO_OWNER;
+}
+
 arena_t *arena_small_allocate(size_t size) {
   arena_t *arena;
   block_t *block;
@@ -22,26 +334,225 @@ arena_t *arena_small_allocate(size_t size) {
   size = min(size, ((size_t)-1) - (10 * getpagesize()));
 
   size_t reqsize = pagealign(size);
-  arena = get_memory(reqsize);
+  uint32_t node = arena_node();
+  arena = get_memory(reqsize, node);
 
   if (arena == NULL)
     return NULL;
 
   arena->kind = SMALL;
+  arena->owner = arena_owner();
+  arena->node = node;
   arena->size = reqsize;
-  LIST_INIT(&arena->freeblks);
   ARENA_SMALL_SET_NULL_TAGS(arena);
 
+  if (!freeidx_init(arena)) {
+    put_memory(arena, reqsize);
+    return NULL;
+  }
+
+  quick_init(arena);
+
   block = ARENA_SMALL_FIRST_BLOCK(arena);
-  block->size = ARENA_SMALL_FIRST_BLOCK_SIZE(reqsize);
+  BLOCK_SET_HEADER(block, ARENA_SMALL_FIRST_BLOCK_SIZE(reqsize), BLOCK_ZERO,
+                   false);
   BLOCK_TAG_UPDATE(block);
-  LIST_INSERT_HEAD(&arena->freeblks, block, link);
+  freeidx_insert(arena, block);
 
   assert_small_new_arena(arena);
 
   return arena;
 }
 
+arena_t *arena_page_allocate(void) {
+  uint32_t node = arena_node();
+  arena_t *arena;
+
+  if ((arena = get_memory(ARENA_MAXSIZE, node)) == NULL)
+    return NULL;
+
+  /* fresh mapping is zero, so every page is free already */
+  arena->kind = PAGE;
+  arena->owner = ARENA_NO_OWNER;
+  arena->node = node;
+  arena->size = ARENA_MAXSIZE;
+  arena->npages = ARENA_MAXSIZE / getpagesize() - 1;
+  arena->usedpages = 0;
+
+  assert_page_arena(arena);
+
+  return arena;
+}
+
+/* Takes first run of free pages long enough for 'size' bytes */
+void *arena_page_run_allocate(arena_t *arena, size_t size) {
+  uint8_t *map = ARENA_PAGE_MAP(arena);
+  size_t n = pagealign(size) / getpagesize();
+  size_t i = 0, j;
+
+  if (n > arena->npages - arena->usedpages)
+    return NULL;
+
+  while (i + n <= arena->npages) {
+    /* skip whole runs in use */
+    if (map[i] != ARENA_PAGE_FREE) {
+      i += map[i];
+      continue;
+    }
+
+    for (j = i; j < i + n && map[j] == ARENA_PAGE_FREE; j++)
+      ;
+
+    if (j == i + n) {
+      map[i] = n;
+      memset(map + i + 1, ARENA_PAGE_INNER, n - 1);
+      arena->usedpages += n;
+      assert_page_arena(arena);
+      return ARENA_PAGE_PTR(arena, i);
+    }
+
+    i = j;
+  }
+
+  return NULL;
+}
+
+void arena_page_run_deallocate(arena_t *arena, void *ptr) {
+  uint8_t *map = ARENA_PAGE_MAP(arena);
+  size_t i = ARENA_PAGE_INDEX(arena, ptr);
+
+  if (!pagealigned(ptr) || i >= arena->npages || map[i] == ARENA_PAGE_FREE
+      || map[i] == ARENA_PAGE_INNER) {
+    debug("Invalid ptr = %p, doesn't start a run of pages", ptr);
+    exit(EXIT_FAILURE);
+  }
+
+  arena->usedpages -= map[i];
+  memset(map + i, ARENA_PAGE_FREE, map[i]);
+  assert_page_arena(arena);
+}
+
+/* Returns number of bytes in run starting at 'ptr' */
+size_t arena_page_run_size(arena_t *arena, void *ptr) {
+  return ARENA_PAGE_MAP(arena)[ARENA_PAGE_INDEX(arena, ptr)] * getpagesize();
+}
+
+/*
+ * Resizes run at 'ptr' in place to hold 'size' bytes. Shrinking always
+ * succeeds, growing fails if pages after the run are not free.
+ */
+bool arena_page_run_resize(arena_t *arena, void *ptr, size_t size) {
+  uint8_t *map = ARENA_PAGE_MAP(arena);
+  size_t i = ARENA_PAGE_INDEX(arena, ptr);
+  size_t n = map[i];
+  size_t want = pagealign(max(size, 1)) / getpagesize();
+
+  if (size > ARENA_MAXSIZE || i + want > arena->npages)
+    return false;
+
+  if (want > n) {
+    for (size_t j = i + n; j < i + want; j++)
+      if (map[j] != ARENA_PAGE_FREE)
+        return false;
+    memset(map + i + n, ARENA_PAGE_INNER, want - n);
+  }
+  else if (want < n) {
+    memset(map + i + want, ARENA_PAGE_FREE, n - want);
+  }
+
+  map[i] = want;
+  arena->usedpages = arena->usedpages - n + want;
+
+  return true;
+}
+
+/*
+ * Size classes of aligned arenas. Slots of every class are aligned at
+ * least to 32, classes above 32 are all multiples of 64, so cache line
+ * and SIMD aligned requests never need padding.
+ */
+const uint32_t arena_aligned_class_size[ARENA_ALIGNED_CLASSES] = {
+  32, 64, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+/* Returns smallest class with slots of 'size' bytes aligned at 'alignment' */
+int arena_aligned_class(size_t alignment, size_t size) {
+  for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++) {
+    size_t slot = arena_aligned_class_size[i];
+    if (slot >= size && ARENA_ALIGNED_SLOT_ALIGNMENT(slot) >= alignment)
+      return i;
+  }
+
+  return -1;
+}
+
+arena_t *arena_aligned_allocate(int class) {
+  uint32_t node = arena_node();
+  arena_t *arena;
+
+  if ((arena = get_memory(ARENA_MAXSIZE, node)) == NULL)
+    return NULL;
+
+  arena->kind = ALIGNED;
+  arena->owner = arena_owner();
+  arena->node = node;
+  arena->size = ARENA_MAXSIZE;
+  arena->slotclass = class;
+  arena->nslots = ((void *)arena + ARENA_MAXSIZE - ARENA_ALIGNED_BASE(arena))
+                  / ARENA_ALIGNED_SLOT_SIZE(arena);
+  arena->usedslots = 0;
+  arena->fresh = 0;
+  arena->freeslots = NULL;
+
+  return arena;
+}
+
+/* Takes most recently freed slot, or the first one never used before */
+void *arena_aligned_slot_allocate(arena_t *arena) {
+  void *slot;
+
+  if ((slot = arena->freeslots))
+    arena->freeslots = *(void **)slot;
+  else if (arena->fresh < arena->nslots)
+    slot = ARENA_ALIGNED_SLOT(arena, arena->fresh++);
+  else
+    return NULL;
+
+  arena->usedslots++;
+  assert_aligned_slot(arena, slot);
+
+  return slot;
+}
+
+void arena_aligned_slot_deallocate(arena_t *arena, void *ptr) {
+  size_t offset = ptr - ARENA_ALIGNED_BASE(arena);
+
+  if (ptr < ARENA_ALIGNED_BASE(arena)
+      || offset % ARENA_ALIGNED_SLOT_SIZE(arena) != 0
+      || offset / ARENA_ALIGNED_SLOT_SIZE(arena) >= arena->fresh) {
+    debug("Invalid ptr = %p, doesn't start a slot", ptr);
+    exit(EXIT_FAILURE);
+  }
+
+  *(void **)ptr = arena->freeslots;
+  arena->freeslots = ptr;
+  arena->usedslots--;
+}
+
+/*
+ * Page aligned size of BIG mapping holding 'size' bytes after 'offset'
+ * bytes of header, or 0 if such mapping can't exist in address space.
+ */
+static size_t arena_big_mapping_size(size_t offset, size_t size) {
+  size_t reqsize;
+
+  if (__builtin_add_overflow(offset, size, &reqsize)
+      || reqsize > (size_t)(PTRDIFF_MAX - getpagesize()))
+    return 0;
+
+  return pagealign(reqsize);
+}
+
 arena_t *arena_big_allocate(size_t alignment, size_t size) {
   assert(powerof2(alignment));
   assert(alignment > 0);
@@ -52,15 +563,14 @@ arena_t *arena_big_allocate(size_t alignment, size_t size) {
 
   arena_t *arena;
   size_t reqsize = pagealign(ARENA_BIG_REQUIRED_SIZE(alignment, size));
+  uint32_t node = arena_node();
 
-  int prot = PROT_READ | PROT_WRITE;
-  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
-  if ((arena = mmap(NULL, reqsize, prot, flags, -1, 0)) == MAP_FAILED) {
-    debug("mmap failed with \"%s\"", strerror(errno));
+  if ((arena = get_memory(reqsize, node)) == NULL)
     return NULL;
-  }
 
   arena->kind = BIG;
+  arena->owner = ARENA_NO_OWNER;
+  arena->node = node;
   arena->size = reqsize;
   arena->data = ARENA_BIG_DATA_PTR(alignment, arena);
   arena->datasize = ARENA_BIG_DATA_SIZE(alignment, reqsize);
@@ -71,7 +581,7 @@ arena_t *arena_big_allocate(size_t alignment, size_t size) {
 }
 
 void arena_big_deallocate(arena_t *arena) {
-  if (munmap(arena, arena->size) < 0) {
+  if (put_memory(arena, arena->size) < 0) {
     debug("munmap failed in BIG arena deallocation");
     exit(EXIT_FAILURE);
   }
@@ -92,24 +602,48 @@ arena_t *arena_big_expand(arena_t *arena, size_t newsize) {
   return new;
 }
 
-arena_t *arena_big_realloc(arena_t *arena, size_t size) {
-  if (size > arena->datasize)
-    return arena_big_expand(arena, size);
-
-  if (size == arena->datasize)
-    return arena;
+/*
+ * Resizes BIG arena in place, so that its data holds 'size' bytes.
+ * Shrinking always succeeds, growing fails if there's no room for
+ * the mapping to grow without moving it elsewhere, or 'size' is more
+ * than any mapping can hold.
+ */
+bool arena_big_resize(arena_t *arena, size_t size) {
+  size_t offset = (void *)arena->data - (void *)arena;
+  size_t reqsize = arena_big_mapping_size(offset, size);
 
-  void *addr = pagealign((void *)arena->data + size);
-  ptrdiff_t diff = ((void *)arena + arena->size) - addr;
+  if (reqsize == 0)
+    return false;
 
-  if (diff > 0) {
-    if (munmap(addr, diff) < 0) {
+  if (reqsize > (size_t)arena->size) {
+    if (!arena_reserve(reqsize - arena->size))
+      return false;
+    HIST_BEGIN(start);
+    void *res = mremap(arena, arena->size, reqsize, 0);
+    HIST_END(MALLOC_LAT_MMAP, start);
+    if (res == MAP_FAILED) {
+      arena_unreserve(reqsize - arena->size);
+      return false;
+    }
+  }
+  else if (reqsize < (size_t)arena->size) {
+    if (put_memory((void *)arena + reqsize, arena->size - reqsize) < 0) {
       debug("munmap failed with '%s'", strerror(errno));
       exit(EXIT_FAILURE);
     }
   }
 
-  return arena;
+  arena->size = reqsize;
+  arena->datasize = reqsize - offset;
+
+  return true;
+}
+
+arena_t *arena_big_realloc(arena_t *arena, size_t size) {
+  if (arena_big_resize(arena, size))
+    return arena;
+
+  return arena_big_expand(arena, size);
 }
 
 static arena_t *arena_check_in_bounds(ma_list_t *arenas, void *ptr) {
@@ -127,61 +661,109 @@ static arena_t *arena_check_in_bounds(ma_list_t *arenas, void *ptr) {
 arena_t *arena_validate_ptr(arenas_t arenas, void *ptr) {
   arena_t *arena;
 
-  if ((arena = arena_check_in_bounds(arenas.small, ptr)) == NULL)
+  if ((arena = arena_check_in_bounds(arenas.small, ptr)) == NULL
+      && (arena = arena_check_in_bounds(arenas.page, ptr)) == NULL)
+    for (int i = 0; i < ARENA_ALIGNED_CLASSES && arena == NULL; i++)
+      arena = arena_check_in_bounds(&arenas.aligned[i], ptr);
+
+  if (arena == NULL)
     arena = arena_check_in_bounds(arenas.big, ptr);
 
   return arena;
 }
 
-void arena_insert_free_block(arena_t *arena, block_t *insert) {
-  assert_free_block(insert);
+/* Counts 'used' bytes of 'arena' as allocated, on its node too */
+static void arena_report_used(arena_t *arena,
+                              struct malloc_heap_report *report, size_t used) {
+  report->allocated_bytes += used;
+  report->node_allocated_bytes[arena->node] += used;
+}
+
+/*
+ * Adds shape of the arena to 'report': free blocks, their size distribution
+ * and occupancy class. It walks only free blocks, not the whole arena.
+ * Returns size of the largest free block.
+ */
+size_t arena_report(arena_t *arena, struct malloc_heap_report *report) {
   block_t *block;
+  size_t largest = 0;
+  size_t free = 0;
 
-  if (LIST_EMPTY(&arena->freeblks)) {
-    LIST_INSERT_HEAD(&arena->freeblks, insert, link);
-    return;
+  report->mapped_bytes += arena->size;
+  report->node_mapped_bytes[arena->node] += arena->size;
+
+  if (arena->kind == BIG) {
+    report->big_arenas++;
+    arena_report_used(arena, report, arena->datasize);
+    return 0;
   }
 
-  LIST_FOREACH(block, &arena->freeblks, link) {
-    assert(insert != block);
-    if (insert < block) {
-      LIST_INSERT_BEFORE(block, insert, link);
-      return;
-    }
+  if (arena->kind == PAGE) {
+    report->page_arenas++;
+    report->page_bytes += arena->usedpages * getpagesize();
+    arena_report_used(arena, report, arena->usedpages * getpagesize());
+    return 0;
   }
-}
 
-uint64_t arena_total_free_size(arena_t *arena) {
-  uint64_t total = 0;
-  block_t *block;
+  if (arena->kind == ALIGNED) {
+    size_t used = arena->usedslots * ARENA_ALIGNED_SLOT_SIZE(arena);
+    report->aligned_arenas++;
+    report->aligned_bytes += used;
+    arena_report_used(arena, report, used);
+    return 0;
+  }
 
-  LIST_FOREACH(block, &arena->freeblks, link)
-    total += (uint64_t)block->size; // free blocks thus size >= 0
+  report->small_arenas++;
 
-  return total;
-}
+  /* we walk its free blocks anyway, so it's a good time to check them */
+  assert_small_arena(arena);
 
-uint64_t arenas_total_free_size(ma_list_t *arenas) {
-  uint64_t total = 0;
+  for (block = freeidx_first(arena); block; block = freeidx_next(arena, block)) {
+    size_t size = BLOCK_SIZE(block);
+    int bin = 63 - __builtin_clzl(size / BLOCK_ALIGNMENT);
 
-  arena_t *arena;
-  LIST_FOREACH(arena, arenas, link)
-    total += arena_total_free_size(arena);
+    free += BLOCK_TOTAL_SIZE(block);
+    largest = max(largest, size);
+    report->free_blocks++;
+    report->free_bytes += size;
+    report->free_histogram[min(bin, MALLOC_REPORT_SIZE_BINS - 1)]++;
+  }
+
+  /* blocks in quick bins are as good as free */
+  for (int i = 0; i < QUICK_BINS; i++) {
+    for (block = arena->quick[i]; block; block = block->qnext) {
+      free += BLOCK_TOTAL_SIZE(block);
+      report->free_blocks++;
+      report->free_bytes += BLOCK_SIZE(block);
+      report->free_histogram[min(63 - __builtin_clzl(i + 1),
+                                 MALLOC_REPORT_SIZE_BINS - 1)]++;
+    }
+  }
 
-  return total;
+  size_t capacity = arena->size - ARENA_HEADER_SIZE - 2*BLOCK_TAG_SIZE;
+  size_t used = capacity - free;
+  int class = (used == 0) ? 0 : 1 + (4 * used - 1) / capacity;
+
+  arena_report_used(arena, report, used);
+  report->occupancy[class]++;
+  report->largest_free = max(report->largest_free, largest);
+
+  return largest;
 }
 
 void arena_small_deallocate(arena_t *arena) {
   LIST_REMOVE(arena, link);
-  if (munmap(arena, arena->size) < 0) {
+  freeidx_destroy(arena);
+  if (put_memory(arena, arena->size) < 0) {
     debug("munmap failed in SMALL arena deallocation");
     exit(EXIT_FAILURE);
   }
 }
 
-block_t *arena_small_realloc(arena_t *arena, block_t *block, size_t newsize) {
+block_t *arena_small_realloc(arenas_t arenas, arena_t *arena, block_t *block,
+                             size_t newsize) {
   /* we need to shrink our block */
-  if (newsize <= abs(block->size)) {
+  if (newsize <= BLOCK_USABLE_SIZE(block)) {
     block_t *tail;
     if ((tail = block_shrink(block, newsize)))
       block_deallocate(arena, tail);
@@ -191,21 +773,686 @@ block_t *arena_small_realloc(arena_t *arena, block_t *block, size_t newsize) {
 
   /* we need to expand our block */
   block_t *expanded;
-  arena_t *new;
+  void *data;
 
-  if ((expanded = block_expand(block, newsize)) == NULL) {
-    if ((new = arena_small_allocate(ARENA_MAXSIZE)))
+  if ((expanded = block_expand(arena, block, newsize)) == NULL) {
+    /* look for free block in all arenas before mapping a new one */
+    if ((data = arenas_allocate(arenas, BLOCK_ALIGNMENT, newsize)) == NULL)
       return NULL;
 
-    LIST_INSERT_AFTER(arena, new, link);
-    expanded = ARENA_SMALL_FIRST_BLOCK(new);
-    expanded = block_free_extract(expanded, BLOCK_ALIGNMENT, newsize);
-    LIST_REMOVE(expanded, link);
-    BLOCK_SET_ALLOCATED(expanded);
-    assert(abs(expanded->size) >= newsize);
-    memcpy(expanded->data, block->data, abs(block->size));
+    expanded = BLOCK_FROM_DATA_PTR(data);
+    assert(BLOCK_USABLE_SIZE(expanded) >= newsize);
+    memcpy(expanded->data, block->data, BLOCK_USABLE_SIZE(block));
     block_deallocate(arena, block);
   }
 
   return expanded;
 }
+
+/*
+ * Resizes allocation at 'ptr' without ever moving it, so that it holds
+ * at least 'size' and, if possible, 'size + extra' bytes. If it can't grow
+ * to 'size', allocation is left as it was. Returns new usable size.
+ */
+size_t arena_resize_inplace(arena_t *arena, void *ptr, size_t size, size_t extra) {
+  size_t limit = (arena->kind == BIG) ? ((size_t)-1) / 2 : ARENA_MAXSIZE;
+  size_t want;
+
+  size = min(max(size, 1), limit);
+  want = (extra > limit - size) ? limit : size + extra;
+
+  if (arena->kind == PAGE) {
+    if (!arena_page_run_resize(arena, ptr, want) && size > arena_page_run_size(arena, ptr))
+      arena_page_run_resize(arena, ptr, size);
+
+    return arena_page_run_size(arena, ptr);
+  }
+
+  /* slots never change size */
+  if (arena->kind == ALIGNED)
+    return ARENA_ALIGNED_SLOT_SIZE(arena);
+
+  if (arena->kind == BIG) {
+    if (want < arena->datasize)
+      arena_big_resize(arena, want);
+    else if (want > arena->datasize && !arena_big_resize(arena, want)
+             && size > arena->datasize)
+      arena_big_resize(arena, size);
+
+    return arena->datasize;
+  }
+
+  block_t *block = BLOCK_FROM_DATA_PTR(ptr);
+  block_t *tail;
+
+  if (want <= BLOCK_USABLE_SIZE(block)) {
+    if ((tail = block_shrink(block, want)))
+      block_deallocate(arena, tail);
+  }
+  else if (block_expand(arena, block, want) == NULL
+           && size > BLOCK_USABLE_SIZE(block)) {
+    block_expand(arena, block, size);
+  }
+
+  return BLOCK_USABLE_SIZE(block);
+}
+
+/*
+ * Calculates usable size of data we hand out for 'size' bytes request
+ * at 'alignment', the same way arenas_allocate does. Returns 0 if such
+ * request can never be satisfied.
+ */
+size_t arena_usable_size(size_t alignment, size_t size) {
+  size_t pagesize = getpagesize();
+
+  if (size > (size_t)-1 - align(ARENA_HEADER_SIZE, alignment) - pagesize)
+    return 0;
+
+  if (ARENA_FITS_IN_PAGE(alignment, size))
+    return pagealign(size);
+
+  if (ARENA_FITS_IN_ALIGNED(alignment, size))
+    return arena_aligned_class_size[arena_aligned_class(alignment, size)];
+
+  if (ARENA_WHAT_KIND_REQUIRED(alignment, size) == BIG)
+    return ARENA_BIG_DATA_SIZE(alignment,
+             pagealign(ARENA_BIG_REQUIRED_SIZE(alignment, size)));
+
+  return BLOCK_REQUIRED_DATA_SIZE(size) + BLOCK_TAG_SIZE;
+}
+
+/* Does 'owner' own any of 'arenas'? */
+static bool arenas_owned(ma_list_t *arenas, uint32_t owner) {
+  arena_t *arena;
+
+  LIST_FOREACH(arena, arenas, link) {
+    if (arena->owner == owner)
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Looks for free block in arenas of 'owner', flushing their quick bins
+ * if there's none at first.
+ */
+static block_t *arenas_small_find(ma_list_t *arenas, uint32_t owner,
+                                  uint32_t node, size_t alignment, size_t size,
+                                  arena_t **arenap) {
+  block_t *block;
+
+  if ((block = block_find_free(arenas, owner, node, alignment, size, arenap)))
+    return block;
+
+  if (!quick_flush_all(arenas, owner))
+    return NULL;
+
+  return block_find_free(arenas, owner, node, alignment, size, arenap);
+}
+
+/* Returns usable size of allocation at 'ptr' in 'arena' */
+size_t arena_ptr_usable_size(arena_t *arena, void *ptr) {
+  if (arena->kind == BIG)
+    return arena->datasize;
+
+  if (arena->kind == PAGE)
+    return arena_page_run_size(arena, ptr);
+
+  if (arena->kind == ALIGNED)
+    return ARENA_ALIGNED_SLOT_SIZE(arena);
+
+  return BLOCK_USABLE_SIZE(BLOCK_FROM_DATA_PTR(ptr));
+}
+
+/*
+ * Takes block for 'size' bytes at 'alignment' from small 'arenas', maps new
+ * arena if needed. Sets 'zero' if block's memory is known to be zero.
+ *
+ * Blocks come from arenas of calling thread. When they're full, we adopt
+ * orphaned arena, then a thread that owns arenas already borrows block
+ * from arena of another thread, rounded out to whole cache lines, so it
+ * doesn't share any with blocks the owner hands out. Only then we map
+ * new arena. Arenas we adopt or borrow from must be on our node.
+ * Shared arenas stay unowned, any thread takes blocks of all of them.
+ */
+static block_t *arenas_small_allocate(arenas_t arenas, size_t alignment,
+                                      size_t size, bool *zero) {
+  uint32_t self = arenas_owner(arenas);
+  uint32_t node = arena_node();
+  arena_t *arena;
+  block_t *block;
+
+  *zero = false;
+
+  if (alignment == BLOCK_ALIGNMENT
+      && (block = quick_pop(arenas.small, self, size, &arena))) {
+    ARENA_ALLOCATED(BLOCK_USABLE_SIZE(block));
+    return block;
+  }
+
+  if ((block = arenas_small_find(arenas.small, self, ARENA_ANY_NODE, alignment,
+                                 size, &arena)) == NULL
+      && (block = arenas_small_find(arenas.small, ARENA_NO_OWNER, node,
+                                    alignment, size, &arena)))
+    arena->owner = self;
+
+  /* only borrowed block is widened, new arena may not fit widened request */
+  if (block == NULL && self != ARENA_NO_OWNER
+      && arenas_owned(arenas.small, self)) {
+    size_t line_alignment = max(alignment, ARENA_CACHE_LINE);
+    /* usable bytes run into footer, so header of next block closes the
+       last line & its data starts on a new one */
+    size_t line_size = align(size + BLOCK_TAG_SIZE, ARENA_CACHE_LINE)
+                       - BLOCK_TAG_SIZE;
+    if ((block = arenas_small_find(arenas.small, ARENA_ANY_OWNER, node,
+                                   line_alignment, line_size, &arena))) {
+      alignment = line_alignment;
+      size = line_size;
+    }
+  }
+
+  if (block == NULL) {
+    if ((arena = arena_small_allocate(ARENA_MAXSIZE)) == NULL)
+      return NULL;
+    arena->owner = self;
+    LIST_INSERT_HEAD(arenas.small, arena, link);
+    block = ARENA_SMALL_FIRST_BLOCK(arena);
+  }
+
+  block = block_free_extract(arena, block, alignment, size);
+  freeidx_remove(arena, block);
+  *zero = BLOCK_FLAGS(block) & BLOCK_ZERO;
+  BLOCK_SET_ALLOCATED(block);
+  ARENA_ALLOCATED(BLOCK_USABLE_SIZE(block));
+
+  return block;
+}
+
+/*
+ * Takes run of pages for 'size' bytes from page 'arenas' on our node, maps
+ * new one if needed.
+ */
+static void *arenas_page_allocate(arenas_t arenas, size_t size) {
+  uint32_t node = arena_node();
+  arena_t *arena;
+  void *ptr = NULL;
+
+  LIST_FOREACH(arena, arenas.page, link) {
+    if (arena->node == node && (ptr = arena_page_run_allocate(arena, size)))
+      break;
+  }
+
+  if (ptr == NULL) {
+    if ((arena = arena_page_allocate()) == NULL)
+      return NULL;
+    LIST_INSERT_HEAD(arenas.page, arena, link);
+    ptr = arena_page_run_allocate(arena, size);
+  }
+
+  ARENA_ALLOCATED(pagealign(size));
+  return ptr;
+}
+
+/*
+ * Takes slot of class 'class' from aligned arenas of 'owner' on 'node'
+ * (or any for ARENA_ANY_OWNER & ARENA_ANY_NODE). Arena with free slots is
+ * moved to the head of its class list, orphaned one is adopted by calling
+ * thread.
+ */
+static void *arenas_aligned_take(arenas_t arenas, int class, uint32_t owner,
+                                 uint32_t node) {
+  ma_list_t *list = &arenas.aligned[class];
+  arena_t *arena;
+  void *ptr;
+
+  LIST_FOREACH(arena, list, link) {
+    if (!ARENA_MATCHES(arena, owner, node))
+      continue;
+    if ((ptr = arena_aligned_slot_allocate(arena))) {
+      if (arena->owner == ARENA_NO_OWNER)
+        arena->owner = arenas_owner(arenas);
+      if (arena != LIST_FIRST(list)) {
+        LIST_REMOVE(arena, link);
+        LIST_INSERT_HEAD(list, arena, link);
+      }
+      ARENA_ALLOCATED(ARENA_ALIGNED_SLOT_SIZE(arena));
+      return ptr;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Takes slot for 'size' bytes at 'alignment' from aligned 'arenas', maps
+ * new one if needed. Goes the same way as arenas_small_allocate, slots
+ * borrowed from another thread must span whole cache lines, so they come
+ * from classes aligned to them.
+ */
+static void *arenas_aligned_allocate(arenas_t arenas, size_t alignment,
+                                     size_t size) {
+  int class = arena_aligned_class(alignment, size);
+  int wide = arena_aligned_class(max(alignment, ARENA_CACHE_LINE), size);
+  uint32_t self = arenas_owner(arenas);
+  uint32_t node = arena_node();
+  arena_t *arena;
+  void *ptr;
+
+  if ((ptr = arenas_aligned_take(arenas, class, self, ARENA_ANY_NODE))
+      || (ptr = arenas_aligned_take(arenas, class, ARENA_NO_OWNER, node)))
+    return ptr;
+
+  if (self != ARENA_NO_OWNER && arenas_owned(&arenas.aligned[class], self)
+      && (ptr = arenas_aligned_take(arenas, wide, ARENA_ANY_OWNER, node)))
+    return ptr;
+
+  if ((arena = arena_aligned_allocate(class)) == NULL)
+    return NULL;
+  arena->owner = self;
+  LIST_INSERT_HEAD(&arenas.aligned[class], arena, link);
+
+  return arenas_aligned_take(arenas, class, self, arena->node);
+}
+
+/*
+ * Takes cached big mapping on our node for 'size' bytes at 'alignment',
+ * which is at most twice as big as needed. Excess is unmapped, so it ends
+ * up the same as fresh one, except for being dirty.
+ */
+static arena_t *arenas_big_reuse(arenas_t arenas, size_t alignment,
+                                 size_t size) {
+  uint32_t node = arena_node();
+  arena_t *arena, *best = NULL;
+
+  if (arenas.cached == NULL)
+    return NULL;
+
+  size_t reqsize =
+    arena_big_mapping_size(align(ARENA_HEADER_SIZE, alignment), size);
+
+  if (reqsize == 0)
+    return NULL;
+
+  LIST_FOREACH(arena, arenas.cached, link) {
+    if (arena->node == node && (size_t)arena->size >= reqsize
+        && (size_t)arena->size / 2 <= reqsize
+        && (best == NULL || arena->size < best->size))
+      best = arena;
+  }
+
+  if (best == NULL)
+    return NULL;
+
+  LIST_REMOVE(best, link);
+
+  if ((size_t)best->size > reqsize
+      && put_memory((void *)best + reqsize, best->size - reqsize) < 0) {
+    debug("munmap failed with '%s'", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  best->size = reqsize;
+  best->dirtied = 0;
+  best->data = ARENA_BIG_DATA_PTR(alignment, best);
+  best->datasize = ARENA_BIG_DATA_SIZE(alignment, reqsize);
+
+  assert_big_arena(best, alignment, size);
+
+  return best;
+}
+
+/* Keeps freed big mapping for reuse, if purging is on & cache has room */
+static bool arenas_big_cache(arenas_t arenas, arena_t *arena) {
+  arena_t *cached;
+  size_t bytes = arena->size;
+
+  if (!arena_purging || arenas.cached == NULL)
+    return false;
+
+  LIST_FOREACH(cached, arenas.cached, link)
+    bytes += cached->size;
+
+  if (bytes > ARENA_CACHE_MAXSIZE)
+    return false;
+
+  arena->dirtied = arena_epoch;
+  LIST_INSERT_HEAD(arenas.cached, arena, link);
+
+  return true;
+}
+
+/* Allocates 'size' bytes at 'alignment' from given arenas, maps new arena if needed */
+void *arenas_allocate(arenas_t arenas, size_t alignment, size_t size) {
+  arena_t *arena;
+  block_t *block;
+  bool zero;
+
+  if (ARENA_FITS_IN_PAGE(alignment, size))
+    return arenas_page_allocate(arenas, size);
+
+  if (ARENA_FITS_IN_ALIGNED(alignment, size))
+    return arenas_aligned_allocate(arenas, alignment, size);
+
+  if (ARENA_WHAT_KIND_REQUIRED(alignment, size) == BIG) {
+    if ((arena = arenas_big_reuse(arenas, alignment, size)) == NULL
+        && (arena = arena_big_allocate(alignment, size)) == NULL)
+      return NULL;
+    LIST_INSERT_HEAD(arenas.big, arena, link);
+    ARENA_ALLOCATED(arena->datasize);
+    return arena->data;
+  }
+
+  if ((block = arenas_small_allocate(arenas, alignment, size, &zero)) == NULL)
+    return NULL;
+
+  return block->data;
+}
+
+/*
+ * Same as arenas_allocate, but memory is zeroed. Fresh mappings are zero
+ * already, so large requests get one of their own & blocks known to be
+ * zero only need what we wrote to them cleared.
+ */
+void *arenas_allocate_zero(arenas_t arenas, size_t size) {
+  arena_t *arena;
+  block_t *block;
+  bool zero;
+
+  if (size >= ARENA_TRESHOLD
+      || ARENA_WHAT_KIND_REQUIRED(BLOCK_ALIGNMENT, size) == BIG) {
+    if ((arena = arena_big_allocate(BLOCK_ALIGNMENT, size)) == NULL)
+      return NULL;
+    LIST_INSERT_HEAD(arenas.big, arena, link);
+    ARENA_ALLOCATED(arena->datasize);
+    return arena->data;
+  }
+
+  if ((block = arenas_small_allocate(arenas, BLOCK_ALIGNMENT, size, &zero))
+      == NULL)
+    return NULL;
+
+  if (zero) {
+    memset(block->data, 0, sizeof(mb_node_t));
+    *BLOCK_TAG_PTR(block) = 0;
+  }
+  else {
+    memset(block->data, 0, size);
+  }
+
+  return block->data;
+}
+
+/*
+ * Releases memory pointed by 'ptr' back to 'arena' it belongs to, one of
+ * 'arenas'. Stamps the arena, so purge thread knows it's been used lately.
+ */
+void arenas_deallocate(arenas_t arenas, arena_t *arena, void *ptr) {
+  ARENA_DEALLOCATED(arena_ptr_usable_size(arena, ptr));
+
+  if (arena->kind == BIG) {
+    LIST_REMOVE(arena, link);
+    if (!arenas_big_cache(arenas, arena))
+      arena_big_deallocate(arena);
+    return;
+  }
+
+  arena->dirtied = arena_epoch;
+
+  if (arena->kind == PAGE) {
+    arena_page_run_deallocate(arena, ptr);
+  }
+  else if (arena->kind == ALIGNED) {
+    arena_aligned_slot_deallocate(arena, ptr);
+  }
+  else if (!quick_push(arena, BLOCK_FROM_DATA_PTR(ptr))) {
+    block_deallocate(arena, BLOCK_FROM_DATA_PTR(ptr));
+  }
+}
+
+/* Was arena freed to & then left alone for decay time? */
+static bool arena_idle(arena_t *arena, bool all) {
+  return arena->dirtied != 0
+         && (all || arena_epoch - arena->dirtied >= ARENA_DECAY_STEPS);
+}
+
+/* Fills 'lent' with whole pages between 'start' & 'end', if there are any */
+static bool arena_purge_pages(arena_purge_t *lent, arena_t *arena, void *ptr,
+                              void *start, void *end) {
+  start = pagealign(start);
+  end = (void *)((uintptr_t)end & -getpagesize());
+
+  if (end <= start)
+    return false;
+
+  *lent = (arena_purge_t){.arena = arena, .ptr = ptr, .start = start,
+                          .len = end - start};
+  return true;
+}
+
+/*
+ * Lends free blocks of small arena spanning whole pages, marked allocated
+ * so neither allocation nor coalescing touches them. Blocks known to be
+ * zero were never written to, so there's nothing to purge in them. Bytes
+ * around the pages are zeroed too, so block comes back known to be zero.
+ */
+static size_t arena_small_lend(arena_t *arena, arena_purge_t *lent, size_t n) {
+  block_t *block;
+  size_t count = 0;
+
+  quick_flush(arena);
+
+  for (block = freeidx_first(arena); block && count < n;
+       block = freeidx_next(arena, block)) {
+    if (!(BLOCK_FLAGS(block) & BLOCK_ZERO)
+        && arena_purge_pages(&lent[count], arena, block, block->data,
+                             (void *)block->data + BLOCK_SIZE(block)))
+      count++;
+  }
+
+  /* free index must not change while we walk it */
+  for (size_t i = 0; i < count; i++) {
+    block = lent[i].ptr;
+    lent[i].head = min((void *)block->data + sizeof(mb_node_t), lent[i].start);
+    lent[i].tail = (void *)block->data + BLOCK_SIZE(block);
+    freeidx_remove(arena, block);
+    BLOCK_SET_ALLOCATED(block);
+  }
+
+  return count;
+}
+
+/* Lends every run of free pages of page arena, as if it was allocated */
+static size_t arena_page_lend(arena_t *arena, arena_purge_t *lent, size_t n) {
+  uint8_t *map = ARENA_PAGE_MAP(arena);
+  size_t count = 0;
+  size_t i = 0, j;
+
+  while (i < arena->npages && count < n) {
+    if (map[i] != ARENA_PAGE_FREE) {
+      i += map[i];
+      continue;
+    }
+
+    for (j = i; j < arena->npages && map[j] == ARENA_PAGE_FREE; j++)
+      ;
+
+    map[i] = j - i;
+    memset(map + i + 1, ARENA_PAGE_INNER, j - i - 1);
+    arena->usedpages += j - i;
+    lent[count++] = (arena_purge_t){.arena = arena,
+                                    .ptr = ARENA_PAGE_PTR(arena, i),
+                                    .start = ARENA_PAGE_PTR(arena, i),
+                                    .len = (j - i) * getpagesize()};
+    i = j;
+  }
+
+  assert_page_arena(arena);
+  return count;
+}
+
+/*
+ * Lends all slots of aligned arena, if none of them is in use, by making
+ * it look full. Partially used arenas are left alone, as their free slots
+ * rarely add up to whole pages.
+ */
+static size_t arena_aligned_lend(arena_t *arena, arena_purge_t *lent) {
+  if (arena->usedslots > 0 || arena->fresh == 0
+      || !arena_purge_pages(lent, arena, NULL, ARENA_ALIGNED_BASE(arena),
+                            (void *)arena + arena->size))
+    return 0;
+
+  arena->fresh = arena->nslots;
+  arena->usedslots = arena->nslots;
+  arena->freeslots = NULL;
+
+  return 1;
+}
+
+static size_t arena_lend(arena_t *arena, arena_purge_t *lent, size_t n) {
+  arena->dirtied = 0;
+
+  if (arena->kind == PAGE)
+    return arena_page_lend(arena, lent, n);
+
+  if (arena->kind == ALIGNED)
+    return arena_aligned_lend(arena, lent);
+
+  return arena_small_lend(arena, lent, n);
+}
+
+/* Has arena nothing in use? Lent memory counts as used. */
+static bool arena_unused(arena_t *arena) {
+  if (arena->kind == PAGE)
+    return arena->usedpages == 0;
+
+  if (arena->kind == ALIGNED)
+    return arena->usedslots == 0;
+
+  quick_flush(arena);
+  return ARENA_EMPTY(arena);
+}
+
+/* Detaches unused arenas of 'list', so they get unmapped as a whole */
+static size_t arenas_purge_unused(ma_list_t *list, arena_purge_t *lent,
+                                  size_t n) {
+  arena_t *arena, *next;
+  size_t count = 0;
+
+  for (arena = LIST_FIRST(list); arena && count < n; arena = next) {
+    next = LIST_NEXT(arena, link);
+    if (arena_unused(arena)) {
+      LIST_REMOVE(arena, link);
+      if (arena->kind == SMALL)
+        freeidx_destroy(arena);
+      lent[count++] = (arena_purge_t){.start = arena, .len = arena->size};
+    }
+  }
+
+  return count;
+}
+
+/*
+ * Lends up to 'n' pieces of memory to be purged, from cached big mappings
+ * or from single arena left alone for decay time. If 'all' is set, any
+ * arena freed to is purged & unused ones are unmapped. Returns 0 when
+ * there's nothing left to purge. Must be called with lock held & followed
+ * by arenas_purge_return.
+ */
+size_t arenas_purge_take(arenas_t arenas, bool all, arena_purge_t *lent,
+                         size_t n) {
+  arena_t *arena, *next;
+  size_t count = 0;
+
+  if (arenas.cached) {
+    for (arena = LIST_FIRST(arenas.cached); arena && count < n; arena = next) {
+      next = LIST_NEXT(arena, link);
+      if (arena_idle(arena, all)) {
+        LIST_REMOVE(arena, link);
+        lent[count++] = (arena_purge_t){.start = arena, .len = arena->size};
+      }
+    }
+  }
+
+  if (all) {
+    count += arenas_purge_unused(arenas.small, lent + count, n - count);
+    count += arenas_purge_unused(arenas.page, lent + count, n - count);
+    for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++)
+      count += arenas_purge_unused(&arenas.aligned[i], lent + count,
+                                   n - count);
+  }
+
+  if (count > 0)
+    return count;
+
+  LIST_FOREACH(arena, arenas.small, link) {
+    if (arena_idle(arena, all) && (count = arena_lend(arena, lent, n)))
+      return count;
+  }
+
+  LIST_FOREACH(arena, arenas.page, link) {
+    if (arena_idle(arena, all) && (count = arena_lend(arena, lent, n)))
+      return count;
+  }
+
+  for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++) {
+    LIST_FOREACH(arena, &arenas.aligned[i], link) {
+      if (arena_idle(arena, all) && (count = arena_lend(arena, lent, n)))
+        return count;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Gives pages lent to purger back to the kernel & zeroes the rest of lent
+ * block, called without lock.
+ */
+void arena_purge_release(arena_purge_t *lent) {
+  if (lent->arena == NULL) {
+    if (put_memory(lent->start, lent->len) < 0) {
+      debug("munmap failed in BIG arena purge");
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (madvise(lent->start, lent->len, MADV_DONTNEED) < 0) {
+    debug("madvise failed with '%s'", strerror(errno));
+    return;
+  }
+
+  if (lent->head) {
+    memset(lent->head, 0, lent->start - lent->head);
+    memset(lent->start + lent->len, 0, lent->tail - lent->start - lent->len);
+    lent->zero = true;
+  }
+}
+
+/* Puts memory lent to purger back, called with lock held */
+void arenas_purge_return(arena_purge_t *lent, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    arena_t *arena = lent[i].arena;
+
+    arena_purged_bytes += lent[i].len;
+
+    if (arena == NULL)
+      continue;
+
+    if (arena->kind == PAGE) {
+      arena_page_run_deallocate(arena, lent[i].ptr);
+    }
+    else if (arena->kind == ALIGNED) {
+      arena->fresh = 0;
+      arena->usedslots = 0;
+    }
+    else {
+      block_t *block = lent[i].ptr;
+      if (lent[i].zero)
+        BLOCK_SET_HEADER(block, BLOCK_SIZE(block),
+                         BLOCK_FLAGS(block) | BLOCK_ZERO, true);
+      block_deallocate(arena, block);
+    }
+  }
+}
@@ -12,27 +12,155 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "malloc.h"
+#include "malloc_ext.h"
 #include "structs.h"
 #include "block.h"
 
+/*
+ * NUMA nodes. Memory is mapped on node of CPU the calling thread runs on
+ * & threads prefer arenas of their node, so each node has a pool of its
+ * own. With single node everything is on node 0 & nothing gets bound.
+ * ARENA_ANY_NODE matches every arena in lookups.
+ */
+#define ARENA_NODES_MAX MALLOC_REPORT_NODES
+#define ARENA_ANY_NODE UINT32_MAX
+
+extern uint32_t arena_nodes;
+
+void arena_numa_init(void);
+uint32_t arena_node(void);
+
+void *get_memory(size_t size, uint32_t node);
+int put_memory(void *mem, size_t size);
+
+/*
+ * Soft heap limit, see malloc_set_heap_limit. Mapping that would cross it
+ * fails & sets 'arena_limited', so that caller knows it may help to make
+ * room once the lock is dropped.
+ */
+extern size_t arena_mapped;
+extern size_t arena_limit;
+extern __thread bool arena_limited __initial_exec;
+
+bool arena_reserve(size_t size);
+void arena_unreserve(size_t size);
+
+/* Prefaulting & warm pool of arenas, see malloc_set_prefault */
+#define ARENA_WARM_MAX 16
+
+extern size_t arena_prefault;
+extern pthread_mutex_t arena_warm_mtx;
+extern sem_t arena_warm_sem;
+
+bool arena_warm_refill(void);
+void arena_warm_resize(size_t target);
+size_t arena_warm_drain(void);
+size_t arena_warm_bytes(uint32_t node);
+
+uint32_t arena_owner(void);
+void arenas_orphan(arenas_t arenas);
+
+/*
+ * Usable bytes handed out to & taken back from calling thread, see
+ * thread_allocated_bytes. Functions named arenas_* count what they do,
+ * arena_* ones leave it to their callers.
+ */
+extern __thread uint64_t arena_thread_allocated __initial_exec;
+extern __thread uint64_t arena_thread_deallocated __initial_exec;
+
+#define ARENA_ALLOCATED(bytes) (arena_thread_allocated += (bytes))
+#define ARENA_DEALLOCATED(bytes) (arena_thread_deallocated += (bytes))
+
 arena_t *arena_validate_ptr(arenas_t arenas, void *ptr);
-void arena_insert_free_block(arena_t *arena, block_t *block);
+void *arenas_allocate(arenas_t arenas, size_t alignment, size_t size);
+void *arenas_allocate_zero(arenas_t arenas, size_t size);
+void arenas_deallocate(arenas_t arenas, arena_t *arena, void *ptr);
+size_t arena_usable_size(size_t alignment, size_t size);
+size_t arena_ptr_usable_size(arena_t *arena, void *ptr);
+size_t arena_resize_inplace(arena_t *arena, void *ptr, size_t size, size_t extra);
 
-uint64_t arena_total_free_size(arena_t *arena);
-uint64_t arenas_total_free_size(ma_list_t *arenas);
+size_t arena_report(arena_t *arena, struct malloc_heap_report *report);
 
 arena_t *arena_big_allocate(size_t alignment, size_t size);
 void arena_big_deallocate(arena_t *arena);
 
 arena_t *arena_big_expand(arena_t *arena, size_t size);
 arena_t *arena_big_realloc(arena_t *arena, size_t size);
+bool arena_big_resize(arena_t *arena, size_t size);
+
+/*
+ * Purging. Purge thread advances 'arena_epoch' every ARENA_DECAY_STEPS-th
+ * part of decay time, every free stamps its arena with it. Arena stamped
+ * at least ARENA_DECAY_STEPS epochs ago was left alone for decay time, so
+ * its free pages are given back to the kernel. While purging is on, freed
+ * big mappings are cached for reuse instead of being unmapped right away.
+ */
+#define ARENA_DECAY_STEPS 8
+
+/* Most bytes of big mappings kept in cache */
+#define ARENA_CACHE_MAXSIZE (32 * ARENA_MAXSIZE)
+
+/* Most pieces of memory lent to purger at once */
+#define ARENA_PURGE_BATCH 128
+
+extern uint32_t arena_epoch;
+extern bool arena_purging;
+extern size_t arena_purged_bytes;
+
+/*
+ * Memory lent to purger. It's taken out of reach of allocation under the
+ * lock, so pages can be released after the lock is dropped.
+ */
+typedef struct arena_purge {
+  arena_t *arena; /* NULL for cached big mapping, which gets unmapped */
+  void *ptr;      /* block or run lent, NULL for whole aligned arena */
+  void *start;    /* pages to release */
+  size_t len;
+  void *head;     /* bytes of block around the pages to zero, if not NULL */
+  void *tail;
+  bool zero;      /* whole block past index node reads as zero now */
+} arena_purge_t;
+
+size_t arenas_purge_take(arenas_t arenas, bool all, arena_purge_t *lent,
+                         size_t n);
+void arena_purge_release(arena_purge_t *lent);
+void arenas_purge_return(arena_purge_t *lent, size_t n);
+
+arena_t *arena_page_allocate(void);
+void *arena_page_run_allocate(arena_t *arena, size_t size);
+void arena_page_run_deallocate(arena_t *arena, void *ptr);
+size_t arena_page_run_size(arena_t *arena, void *ptr);
+bool arena_page_run_resize(arena_t *arena, void *ptr, size_t size);
+
+int arena_aligned_class(size_t alignment, size_t size);
+arena_t *arena_aligned_allocate(int class);
+void *arena_aligned_slot_allocate(arena_t *arena);
+void arena_aligned_slot_deallocate(arena_t *arena, void *ptr);
 
 arena_t *arena_small_allocate(size_t size);
 void arena_small_deallocate(arena_t *arena);
-block_t *arena_small_realloc(arena_t *arena, block_t *block, size_t size);
+block_t *arena_small_realloc(arenas_t arenas, arena_t *arena, block_t *block,
+                             size_t size);
+
+
+/*
+ * Memory borrowed from arena owned by another thread is rounded out to
+ * whole cache lines, so it doesn't share any with owner's objects.
+ */
+#define ARENA_CACHE_LINE 64
 
+/* Is 'arena' of 'owner' & on 'node'? ANY values match every arena. */
+#define ARENA_MATCHES(arena, owner, node) \
+  (((owner) == ARENA_ANY_OWNER || (arena)->owner == (owner)) \
+   && ((node) == ARENA_ANY_NODE || (arena)->node == (node)))
 
 /* Maximum size of SMALL arena. */
 #define ARENA_MAXSIZE (BLOCK_ALIGNMENT * 32768)
@@ -44,19 +172,15 @@ block_t *arena_small_realloc(arena_t *arena, block_t *block, size_t size);
 
 /* Does arena consists of only one block which is free? */
 #define ARENA_EMPTY(arena) \
-  ((ARENA_SMALL_FIRST_BLOCK(arena) == ARENA_SMALL_LAST_BLOCK(arena)) \
-   && BLOCK_IS_FREE(ARENA_SMALL_FIRST_BLOCK(arena)))
+  (BLOCK_IS_FREE(ARENA_SMALL_FIRST_BLOCK(arena)) \
+   && BLOCK_NEXT(ARENA_SMALL_FIRST_BLOCK(arena)) == NULL)
 
 /* Size of arena header. Aligned to double machine word. */
 #define ARENA_HEADER_SIZE (align(sizeof(arena_t), BLOCK_ALIGNMENT))
 
-/* Address of arena last block tag */
-#define ARENA_SMALL_LAST_BLOCK_TAG_PTR(arena) \
-  ((mb_tag_t *)((void *)(arena) + ((arena)->size) - 2*BLOCK_TAG_SIZE))
-
-/* Address of last block in the arena */
-#define ARENA_SMALL_LAST_BLOCK(arena) \
-  ((block_t *)BLOCK_FROM_TAG_PTR(ARENA_SMALL_LAST_BLOCK_TAG_PTR(arena)))
+/* Address of NUL tag following the last block in the arena */
+#define ARENA_SMALL_END(arena) \
+  ((void *)(arena) + ((arena)->size) - BLOCK_TAG_SIZE)
 
 /* Returns pointer to first small arena block */
 #define ARENA_SMALL_FIRST_BLOCK(arena) \
@@ -119,6 +243,60 @@ block_t *arena_small_realloc(arena_t *arena, block_t *block, size_t size);
 #define ARENA_BIG_DATA_SIZE(alignment, total) \
   ((total) - align(ARENA_HEADER_SIZE, alignment))
 
+/*
+ * Page arena is ARENA_MAXSIZE long. First page holds its header followed
+ * by map with a byte for every page after it: length of run starting at
+ * that page, ARENA_PAGE_FREE or ARENA_PAGE_INNER for rest of run's pages.
+ */
+#define ARENA_PAGE_FREE 0
+#define ARENA_PAGE_INNER 0xff
+
+#define ARENA_PAGE_MAP(arena) \
+  ((uint8_t *)(arena) + ARENA_HEADER_SIZE)
+
+/* Address of i-th page handed out from arena & the other way round */
+#define ARENA_PAGE_PTR(arena, i) \
+  ((void *)(arena) + ((i) + 1) * getpagesize())
+
+#define ARENA_PAGE_INDEX(arena, ptr) \
+  ((size_t)((void *)(ptr) - (void *)(arena)) / getpagesize() - 1)
+
+/* Given alignment and size, check if request is served by page arena */
+#define ARENA_FITS_IN_PAGE(alignment, size) \
+  ((alignment) == (size_t)getpagesize() \
+   && (size) <= ARENA_MAXSIZE - (size_t)getpagesize())
+
+/*
+ * Aligned arena is ARENA_MAXSIZE long too. Its slots start at first address
+ * after header aligned like slots themselves, which is the lowest set bit
+ * of class size: 64 for 192, 128 for 384, but 32 for 32 and so on.
+ */
+#define ARENA_ALIGNED_CLASSES 11
+#define ARENA_ALIGNED_MAX_SIZE 2048
+
+#define ARENA_ALIGNED_SLOT_SIZE(arena) \
+  (arena_aligned_class_size[(arena)->slotclass])
+
+#define ARENA_ALIGNED_SLOT_ALIGNMENT(size) ((size) & -(size))
+
+#define ARENA_ALIGNED_BASE(arena) \
+  ((void *)(arena) + align(ARENA_HEADER_SIZE, \
+     ARENA_ALIGNED_SLOT_ALIGNMENT(ARENA_ALIGNED_SLOT_SIZE(arena))))
+
+/* Address of i-th slot of arena */
+#define ARENA_ALIGNED_SLOT(arena, i) \
+  (ARENA_ALIGNED_BASE(arena) + (size_t)(i) * ARENA_ALIGNED_SLOT_SIZE(arena))
+
+/*
+ * Given alignment and size, check if request is worth a slot in aligned
+ * arena. Default alignment never needs padding blocks, so it stays small.
+ */
+#define ARENA_FITS_IN_ALIGNED(alignment, size) \
+  ((alignment) > BLOCK_ALIGNMENT && (alignment) <= ARENA_ALIGNED_MAX_SIZE \
+   && (size) <= ARENA_ALIGNED_MAX_SIZE)
+
+extern const uint32_t arena_aligned_class_size[ARENA_ALIGNED_CLASSES];
+
 /* Given arena and ptr, checks if ptr lies in arena meomry bounds */
 #define ARENA_PTR_IN_BOUNDS(arena, ptr) \
   ((void *)ptr >= (void *)(arena) && (void *)ptr <= ((void *)(arena) + (arena)->size))
@@ -1,11 +1,26 @@
 #include "block.h"
+#include "freeidx.h"
+#include "quick.h"
 #include "invariants.h"
 
-static bool block_can_fit(block_t *block, size_t alignment, size_t size) {
+/* Bytes split off in front of blocks to align them, since start */
+size_t block_padding_bytes = 0;
+size_t block_padding_blocks = 0;
+
+/*
+ * Checks if free 'block' holding 'datasize' bytes can fit 'size' bytes at
+ * 'alignment'. Apart from 'datasize' it needs nothing but block's address.
+ */
+bool block_can_fit(block_t *block, size_t datasize, size_t alignment, size_t size) {
   assert(alignment >= 16); // BLOCK_REQURIED_PADDING_SIZE
 
-  size_t total = BLOCK_TOTAL_SIZE(block);
+  size_t total = datasize + 2*BLOCK_TAG_SIZE;
   size_t required = BLOCK_REQUIRED_PADDING_SIZE(alignment, block);
+
+  /* padding alone doesn't fit, 'remaining' would wrap around */
+  if (required >= total)
+    return false;
+
   size_t remaining = total - required;
 
   assert(aligned(remaining, BLOCK_ALIGNMENT));
@@ -13,14 +28,21 @@ static bool block_can_fit(block_t *block, size_t alignment, size_t size) {
   return BLOCK_CAN_FIT_IN(remaining, size);
 }
 
-block_t *block_find_free(ma_list_t *arenas, size_t alignment, size_t size) {
+/*
+ * Looks for free block in 'arenas' of 'owner' on 'node' (ARENA_ANY_OWNER
+ * & ARENA_ANY_NODE match all of them), sets 'arenap' to arena it's in.
+ */
+block_t *block_find_free(ma_list_t *arenas, uint32_t owner, uint32_t node,
+                         size_t alignment, size_t size, arena_t **arenap) {
   block_t *block;
   arena_t *arena;
 
   LIST_FOREACH(arena, arenas, link) {
-    LIST_FOREACH(block, &arena->freeblks, link) {
-      if (block_can_fit(block, alignment, size))
-        return block;
+    if (!ARENA_MATCHES(arena, owner, node))
+      continue;
+    if ((block = freeidx_find(arena, alignment, size))) {
+      *arenap = arena;
+      return block;
     }
   }
 
@@ -40,9 +62,10 @@ block_t *block_free_split(block_t *block, size_t size) {
   block_t *head = block;
   block_t *tail = (void *)block + size;
 
-  head->size = BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(size);
+  BLOCK_SET_HEADER(tail, BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(total - size),
+                   BLOCK_PREV_FREE | (BLOCK_FLAGS(block) & BLOCK_ZERO), false);
+  BLOCK_RESIZE(head, BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(size));
   BLOCK_TAG_UPDATE(head);
-  tail->size = BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(total - size);
   BLOCK_TAG_UPDATE(tail);
 
   assert_free_block(head);
@@ -51,7 +74,8 @@ block_t *block_free_split(block_t *block, size_t size) {
   return tail;
 }
 
-block_t *block_free_extract(block_t *block, size_t alignment, size_t size) {
+block_t *block_free_extract(arena_t *arena, block_t *block, size_t alignment,
+                            size_t size) {
   assert_free_block(block);
 
   block_t *head;
@@ -64,30 +88,63 @@ block_t *block_free_extract(block_t *block, size_t alignment, size_t size) {
   size_t trailing = remaining - required;
 
   if (padding) {
+    block_padding_bytes += padding;
+    block_padding_blocks++;
     head = block;
     tail = block_free_split(head, padding);
-    LIST_INSERT_AFTER(block, tail, link);
+    freeidx_update(arena, head);
+    freeidx_insert_after(arena, head, tail);
     block = tail;
   }
 
   if (trailing >= BLOCK_REQUIRED_MIN_SIZE) {
     head = block;
     tail = block_free_split(head, required);
-    LIST_INSERT_AFTER(head, tail, link);
+    freeidx_update(arena, head);
+    freeidx_insert_after(arena, head, tail);
     block = head;
   }
 
   return block;
 }
 
+/*
+ * Carves up to 'n' blocks of 'size' bytes one after another from the free
+ * 'block', stores their data pointers in 'out' and returns how many we got.
+ * Each block is cut from the tail left over by the previous one, so we
+ * don't have to look for free block again for every allocation.
+ */
+size_t block_free_carve(arena_t *arena, block_t *block, size_t size, size_t n,
+                        void **out) {
+  block_t *extracted;
+  size_t i;
+
+  for (i = 0; i < n && block; i++) {
+    if (!block_can_fit(block, BLOCK_SIZE(block), BLOCK_ALIGNMENT, size))
+      break;
+
+    extracted = block_free_extract(arena, block, BLOCK_ALIGNMENT, size);
+
+    /* tail left after split, if any, is the next block & it's free */
+    block = BLOCK_NEXT(extracted);
+    if (block && !BLOCK_IS_FREE(block))
+      block = NULL;
+
+    freeidx_remove(arena, extracted);
+    BLOCK_SET_ALLOCATED(extracted);
+    out[i] = extracted->data;
+  }
+
+  return i;
+}
+
 block_t *block_coalesce_forward(block_t *block) {
-  mb_tag_t orginal = block->size;
   block_t *next = BLOCK_NEXT(block);
   assert(next);
 
-  block->size = abs(block->size) + BLOCK_TOTAL_SIZE(next);
-  if (orginal < 0)
-    block->size = -block->size;
+  /* tags & index node of 'next' end up in data, so it isn't zero anymore */
+  BLOCK_SET_HEADER(block, BLOCK_SIZE(block) + BLOCK_TOTAL_SIZE(next),
+                   BLOCK_FLAGS(block) & ~BLOCK_ZERO, BLOCK_IS_ALLOCATED(block));
   BLOCK_TAG_UPDATE(block);
 
   return block;
@@ -96,25 +153,32 @@ block_t *block_coalesce_forward(block_t *block) {
 void block_deallocate(arena_t *arena, block_t *block) {
   assert_allocated_block(block);
 
+  block_t *next = BLOCK_NEXT(block);
+
+  /* don't leave quick block stranded between free ones */
+  if (next && (BLOCK_FLAGS(next) & BLOCK_QUICK))
+    quick_take(arena, next);
+
   BLOCK_SET_FREE(block);
 
   block_t *prev = BLOCK_PREV(block);
-  block_t *next = BLOCK_NEXT(block);
 
+  /* index is told about blocks only once their size is final */
   if (prev && BLOCK_IS_FREE(prev)) {
+    bool merge_next = next && BLOCK_IS_FREE(next);
+    if (merge_next)
+      freeidx_remove(arena, next);
     block = block_coalesce_forward(prev);
-    if (next && BLOCK_IS_FREE(next)) {
-      LIST_REMOVE(next, link);
+    if (merge_next)
       block = block_coalesce_forward(block);
-    }
+    freeidx_update(arena, block);
   }
   else if (next && BLOCK_IS_FREE(next)) {
-    LIST_INSERT_BEFORE(next, block, link);
-    LIST_REMOVE(next, link);
     block = block_coalesce_forward(block);
+    freeidx_replace(arena, next, block);
   }
   else {
-    arena_insert_free_block(arena, block);
+    freeidx_insert(arena, block);
   }
 
   /* TODO: We need treshold freeing here! */
@@ -122,7 +186,7 @@ void block_deallocate(arena_t *arena, block_t *block) {
 
 /* It shrinks first block & returns the tail if any */
 block_t *block_shrink(block_t *block, size_t size) {
-  assert(abs(block->size) >= size);
+  assert(BLOCK_USABLE_SIZE(block) >= size);
 
   size_t total = BLOCK_TOTAL_SIZE(block);
   size_t required = BLOCK_REQUIRED_SIZE(size);
@@ -134,18 +198,21 @@ block_t *block_shrink(block_t *block, size_t size) {
   block_t *head = block;
   block_t *tail = (void *)block + required;
 
-  head->size = BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(required);
-  BLOCK_SET_ALLOCATED(head);
-  tail->size = BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(remaining);
-  BLOCK_SET_ALLOCATED(tail);
+  BLOCK_SET_HEADER(tail, BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(remaining), 0, true);
+  BLOCK_RESIZE(head, BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(required));
+  BLOCK_TAG_UPDATE(head);
 
   return tail;
 }
 
 /* Expands current block using block after it or NULL otherwise */
-block_t *block_expand(block_t *block, size_t size) {
+block_t *block_expand(arena_t *arena, block_t *block, size_t size) {
   block_t *next = BLOCK_NEXT(block);
 
+  /* block in quick bin is free really, so coalesce it now */
+  if (next && (BLOCK_FLAGS(next) & BLOCK_QUICK))
+    quick_take(arena, next);
+
   /* there's no room for expansion */
   if (!next || !BLOCK_IS_FREE(next))
     return NULL;
@@ -164,14 +231,13 @@ block_t *block_expand(block_t *block, size_t size) {
   /* not enough size for tail block, coalesce then */
   if (remaining < BLOCK_REQUIRED_MIN_SIZE
       || diff < (BLOCK_REQUIRED_MIN_SIZE)) {
-    LIST_REMOVE(next, link);
+    freeidx_remove(arena, next);
     return block_coalesce_forward(block);
   }
 
   /* we are guanranteed the head block form split is big enough */
   block_t *tail = block_free_split(next, diff);
-  LIST_INSERT_AFTER(next, tail, link);
-  LIST_REMOVE(next, link);
+  freeidx_replace(arena, next, tail);
   block = block_coalesce_forward(block);
 
   return block;
@@ -15,12 +15,20 @@
 #include "structs.h"
 #include "arena.h"
 
+extern size_t block_padding_bytes;
+extern size_t block_padding_blocks;
+
 block_t *block_coalesce_forward(block_t *block);
-block_t *block_find_free(ma_list_t *arenas, size_t alignment, size_t size);
-block_t *block_free_extract(block_t *block, size_t alignment, size_t size);
+bool block_can_fit(block_t *block, size_t datasize, size_t alignment, size_t size);
+block_t *block_find_free(ma_list_t *arenas, uint32_t owner, uint32_t node,
+                         size_t alignment, size_t size, arena_t **arenap);
+block_t *block_free_extract(arena_t *arena, block_t *block, size_t alignment,
+                            size_t size);
+size_t block_free_carve(arena_t *arena, block_t *block, size_t size, size_t n,
+                        void **out);
 void block_deallocate(arena_t *arena, block_t *block);
 block_t *block_shrink(block_t *block, size_t size);
-block_t *block_expand(block_t *block, size_t size);
+block_t *block_expand(arena_t *arena, block_t *block, size_t size);
 
 #define BLOCK_IS_FREE(block) \
   ((block)->size > 0 ? true : false)
@@ -28,15 +36,52 @@ block_t *block_expand(block_t *block, size_t size);
 #define BLOCK_IS_ALLOCATED(block) \
   (!BLOCK_IS_FREE(block))
 
+/* Previous block is free, so it has footer we can reach it with */
+#define BLOCK_PREV_FREE 1
+
+/* Block is freed, but sits in quick bin still marked allocated */
+#define BLOCK_QUICK 2
+
+/*
+ * Data of free block is zero, except for index node at its start and its
+ * footer, as the memory wasn't touched since it was mapped.
+ */
+#define BLOCK_ZERO 4
+
+/* Size of data is multiple of 16, so its lowest bits hold flags */
+#define BLOCK_FLAGS_MASK \
+  (BLOCK_ALIGNMENT - 1)
+
+#define BLOCK_SIZE(block) \
+  ((size_t)abs((block)->size) & ~BLOCK_FLAGS_MASK)
+
+#define BLOCK_FLAGS(block) \
+  ((size_t)abs((block)->size) & BLOCK_FLAGS_MASK)
+
+#define BLOCK_SET_HEADER(block, datasize, flags, allocated) \
+  ((block)->size = (allocated) ? -(mb_tag_t)((datasize) | (flags)) \
+                               : (mb_tag_t)((datasize) | (flags)))
+
+/* Changes size of data, keeps flags & state. Tags must be updated after. */
+#define BLOCK_RESIZE(block, datasize) \
+  BLOCK_SET_HEADER(block, datasize, BLOCK_FLAGS(block), BLOCK_IS_ALLOCATED(block))
+
+#define BLOCK_SET_PREV_FREE(block, free) \
+  BLOCK_SET_HEADER(block, BLOCK_SIZE(block), \
+                   (free) ? BLOCK_FLAGS(block) | BLOCK_PREV_FREE \
+                          : BLOCK_FLAGS(block) & ~BLOCK_PREV_FREE, \
+                   BLOCK_IS_ALLOCATED(block))
+
 #define BLOCK_SET_ALLOCATED(block) \
   do { \
-    ((block)->size) = -abs((block)->size); \
+    BLOCK_SET_HEADER(block, BLOCK_SIZE(block), \
+                     BLOCK_FLAGS(block) & ~BLOCK_ZERO, true); \
     BLOCK_TAG_UPDATE(block); \
   } while(0)
 
 #define BLOCK_SET_FREE(block) \
   do { \
-    ((block)->size) = abs((block)->size); \
+    BLOCK_SET_HEADER(block, BLOCK_SIZE(block), BLOCK_FLAGS(block), false); \
     BLOCK_TAG_UPDATE(block); \
   } while(0)
 
@@ -47,14 +92,18 @@ block_t *block_expand(block_t *block, size_t size);
   (sizeof(mb_tag_t))
 
 #define BLOCK_TAG_PTR(block) \
-  ((mb_tag_t *)((void *)(block->data) + abs((block)->size)))
+  ((mb_tag_t *)((void *)(block->data) + BLOCK_SIZE(block)))
 
 #define BLOCK_TAG(block) \
   (*((mb_tag_t *)BLOCK_TAG_PTR(block)))
 
 /* for a given block pointer, return total size in bytes including tags */
 #define BLOCK_TOTAL_SIZE(block) \
-  (abs((block)->size) + 2*BLOCK_TAG_SIZE)
+  (BLOCK_SIZE(block) + 2*BLOCK_TAG_SIZE)
+
+/* allocated block has no footer, so its place is given to the user */
+#define BLOCK_USABLE_SIZE(block) \
+  (BLOCK_SIZE(block) + BLOCK_TAG_SIZE)
 
 #define BLOCK_DATA_SIZE_FROM_TOTAL_SIZE(total) \
   ((total) - 2*BLOCK_TAG_SIZE)
@@ -66,13 +115,18 @@ block_t *block_expand(block_t *block, size_t size);
 #define BLOCK_REQUIRED_DATA_MIN_SIZE \
   (BLOCK_ALIGNMENT)
 
-/* given size of data, calculate total size required for block */
+/* given requested size, calculate size of data, last bytes go in footer */
+#define BLOCK_REQUIRED_DATA_SIZE(size) \
+  max(BLOCK_REQUIRED_DATA_MIN_SIZE, \
+      align((size) - min((size), BLOCK_TAG_SIZE), BLOCK_ALIGNMENT))
+
+/* given requested size, calculate total size required for block */
 #define BLOCK_REQUIRED_SIZE(size) \
-  (BLOCK_TAG_SIZE + align(size, BLOCK_ALIGNMENT) + BLOCK_TAG_SIZE)
+  (BLOCK_TAG_SIZE + BLOCK_REQUIRED_DATA_SIZE(size) + BLOCK_TAG_SIZE)
 
 /* Given total available space, check if can fit block of specified size */
 #define BLOCK_CAN_FIT_IN(total, size) \
-  ((total) - 2*BLOCK_TAG_SIZE >= size)
+  ((total) >= BLOCK_REQUIRED_SIZE(size))
 
 /*
  * Calculates size of front padding block, so that following block.data
@@ -86,27 +140,36 @@ block_t *block_expand(block_t *block, size_t size);
           + BLOCK_TAG_SIZE, alignment)                \
      - BLOCK_TAG_SIZE) - (void *)(block)))
 
-/* Update block's tag */
+/*
+ * Update block's tags after its size or state changed: free block gets
+ * footer and next block learns whether the one before it is free.
+ */
 #define BLOCK_TAG_UPDATE(block) \
-  (*((mb_tag_t *)((void *)(block->data) + abs((block)->size))) = ((block)->size))
+  do { \
+    block_t *__next = BLOCK_NEXT(block); \
+    if (BLOCK_IS_FREE(block)) \
+      BLOCK_TAG(block) = BLOCK_SIZE(block); \
+    if (__next) \
+      BLOCK_SET_PREV_FREE(__next, BLOCK_IS_FREE(block)); \
+  } while(0)
 
 /* Given data ptr return pointer to block */
 #define BLOCK_FROM_DATA_PTR(ptr) \
   ((block_t *)((void *)((void *)(ptr) - BLOCK_TAG_SIZE)))
 
-/* Given ending tag pointer return address of block */
+/* Given footer pointer return address of block */
 #define BLOCK_FROM_TAG_PTR(tag) \
-  ((block_t *)((void *)(tag) - abs(*(tag)) - BLOCK_TAG_SIZE))
+  ((block_t *)((void *)(tag) - *(tag) - BLOCK_TAG_SIZE))
 
 /* Returns address of prev block tag */
 #define BLOCK_PREV_TAG_PTR(block) \
   ((mb_tag_t *)((void *)(block) - BLOCK_TAG_SIZE))
 
-/* Returns previous block following tags, NULL if block is first on the arena */
+/* Returns previous block if it's free, NULL otherwise */
 #define BLOCK_PREV(block) \
-  (*((mb_tag_t *)BLOCK_PREV_TAG_PTR(block)) == 0 \
-   ? NULL \
-   : BLOCK_FROM_TAG_PTR(BLOCK_PREV_TAG_PTR(block)))
+  ((BLOCK_FLAGS(block) & BLOCK_PREV_FREE) \
+   ? BLOCK_FROM_TAG_PTR(BLOCK_PREV_TAG_PTR(block)) \
+   : NULL)
 
 /* Returns next block following tags, NULL if block is last on the arena */
 #define BLOCK_NEXT(block) \
@@ -0,0 +1,542 @@
+#include "malloc.h"
+#include "arena.h"
+#include "freeidx.h"
+#include "invariants.h"
+
+#ifndef FREE_ARRAY
+
+/*
+ * Red-black tree ordered by address, threaded through free blocks. Every
+ * node knows the largest data size in its subtree, so address ordered
+ * first fit takes O(log n) just like insertion & removal.
+ */
+
+#define RED 1
+
+#define BLK(arena, x) ((block_t *)((void *)(arena) + (x)))
+#define NODE(arena, x) (&BLK(arena, x)->node)
+#define OFFSET(arena, block) ((uint32_t)((void *)(block) - (void *)(arena)))
+
+#define LEFT(x) NODE(arena, x)->left
+#define RIGHT(x) NODE(arena, x)->right
+#define PARENT(x) NODE(arena, x)->parent
+#define IS_RED(x) ((x) && (NODE(arena, x)->max & RED))
+#define SET_RED(x) (NODE(arena, x)->max |= RED)
+#define SET_BLACK(x) (NODE(arena, x)->max &= ~RED)
+#define MAX(x) ((x) ? NODE(arena, x)->max & ~RED : 0)
+#define SIZE(x) ((uint32_t)BLOCK_SIZE(BLK(arena, x)))
+
+static void tree_fix_max(arena_t *arena, uint32_t x) {
+  uint32_t m = max(SIZE(x), max(MAX(LEFT(x)), MAX(RIGHT(x))));
+  NODE(arena, x)->max = m | (NODE(arena, x)->max & RED);
+}
+
+static void tree_fix_max_up(arena_t *arena, uint32_t x) {
+  for (; x; x = PARENT(x))
+    tree_fix_max(arena, x);
+}
+
+/* Puts 'y' in place of 'x' as a child of x's parent */
+static void tree_transplant(arena_t *arena, uint32_t x, uint32_t y) {
+  uint32_t p = PARENT(x);
+
+  if (p == 0)
+    arena->freeblks.root = y;
+  else if (LEFT(p) == x)
+    LEFT(p) = y;
+  else
+    RIGHT(p) = y;
+
+  if (y)
+    PARENT(y) = p;
+}
+
+static void tree_rotate_left(arena_t *arena, uint32_t x) {
+  uint32_t y = RIGHT(x);
+
+  RIGHT(x) = LEFT(y);
+  if (LEFT(y))
+    PARENT(LEFT(y)) = x;
+  tree_transplant(arena, x, y);
+  LEFT(y) = x;
+  PARENT(x) = y;
+
+  tree_fix_max(arena, x);
+  tree_fix_max(arena, y);
+}
+
+static void tree_rotate_right(arena_t *arena, uint32_t x) {
+  uint32_t y = LEFT(x);
+
+  LEFT(x) = RIGHT(y);
+  if (RIGHT(y))
+    PARENT(RIGHT(y)) = x;
+  tree_transplant(arena, x, y);
+  RIGHT(y) = x;
+  PARENT(x) = y;
+
+  tree_fix_max(arena, x);
+  tree_fix_max(arena, y);
+}
+
+static void tree_insert_fixup(arena_t *arena, uint32_t z) {
+  while (IS_RED(PARENT(z))) {
+    uint32_t p = PARENT(z);
+    uint32_t g = PARENT(p);
+
+    if (p == LEFT(g)) {
+      uint32_t u = RIGHT(g);
+      if (IS_RED(u)) {
+        SET_BLACK(p);
+        SET_BLACK(u);
+        SET_RED(g);
+        z = g;
+        continue;
+      }
+      if (z == RIGHT(p)) {
+        tree_rotate_left(arena, p);
+        z = p;
+        p = PARENT(z);
+      }
+      SET_BLACK(p);
+      SET_RED(g);
+      tree_rotate_right(arena, g);
+    }
+    else {
+      uint32_t u = LEFT(g);
+      if (IS_RED(u)) {
+        SET_BLACK(p);
+        SET_BLACK(u);
+        SET_RED(g);
+        z = g;
+        continue;
+      }
+      if (z == LEFT(p)) {
+        tree_rotate_right(arena, p);
+        z = p;
+        p = PARENT(z);
+      }
+      SET_BLACK(p);
+      SET_RED(g);
+      tree_rotate_left(arena, g);
+    }
+  }
+
+  SET_BLACK(arena->freeblks.root);
+}
+
+/* 'x' took place of removed black node, 'p' is its parent as 'x' may be 0 */
+static void tree_remove_fixup(arena_t *arena, uint32_t x, uint32_t p) {
+  while (x != arena->freeblks.root && !IS_RED(x)) {
+    if (x == LEFT(p)) {
+      uint32_t w = RIGHT(p);
+      if (IS_RED(w)) {
+        SET_BLACK(w);
+        SET_RED(p);
+        tree_rotate_left(arena, p);
+        w = RIGHT(p);
+      }
+      if (!IS_RED(LEFT(w)) && !IS_RED(RIGHT(w))) {
+        SET_RED(w);
+        x = p;
+        p = PARENT(x);
+        continue;
+      }
+      if (!IS_RED(RIGHT(w))) {
+        SET_BLACK(LEFT(w));
+        SET_RED(w);
+        tree_rotate_right(arena, w);
+        w = RIGHT(p);
+      }
+      NODE(arena, w)->max = (NODE(arena, w)->max & ~RED) | (NODE(arena, p)->max & RED);
+      SET_BLACK(p);
+      SET_BLACK(RIGHT(w));
+      tree_rotate_left(arena, p);
+      x = arena->freeblks.root;
+    }
+    else {
+      uint32_t w = LEFT(p);
+      if (IS_RED(w)) {
+        SET_BLACK(w);
+        SET_RED(p);
+        tree_rotate_right(arena, p);
+        w = LEFT(p);
+      }
+      if (!IS_RED(LEFT(w)) && !IS_RED(RIGHT(w))) {
+        SET_RED(w);
+        x = p;
+        p = PARENT(x);
+        continue;
+      }
+      if (!IS_RED(LEFT(w))) {
+        SET_BLACK(RIGHT(w));
+        SET_RED(w);
+        tree_rotate_left(arena, w);
+        w = LEFT(p);
+      }
+      NODE(arena, w)->max = (NODE(arena, w)->max & ~RED) | (NODE(arena, p)->max & RED);
+      SET_BLACK(p);
+      SET_BLACK(LEFT(w));
+      tree_rotate_right(arena, p);
+      x = arena->freeblks.root;
+    }
+  }
+
+  if (x)
+    SET_BLACK(x);
+}
+
+static uint32_t tree_minimum(arena_t *arena, uint32_t x) {
+  while (LEFT(x))
+    x = LEFT(x);
+  return x;
+}
+
+/* Lowest addressed node in subtree of 'x' above 'after' with 'need' bytes */
+static uint32_t tree_first_fit(arena_t *arena, uint32_t x, uint32_t after,
+                               uint32_t need) {
+  while (x && MAX(x) >= need) {
+    if (x > after) {
+      uint32_t y = tree_first_fit(arena, LEFT(x), after, need);
+      if (y)
+        return y;
+      if (SIZE(x) >= need)
+        return x;
+    }
+    x = RIGHT(x);
+  }
+
+  return 0;
+}
+
+bool freeidx_init(arena_t *arena) {
+  arena->freeblks.root = 0;
+  return true;
+}
+
+void freeidx_destroy(__unused arena_t *arena) {
+}
+
+void freeidx_insert(arena_t *arena, block_t *block) {
+  assert_free_block(block);
+
+  uint32_t z = OFFSET(arena, block);
+  uint32_t size = SIZE(z);
+  uint32_t p = 0;
+  uint32_t *link = &arena->freeblks.root;
+
+  /* subtrees we go through will contain the block */
+  while (*link) {
+    p = *link;
+    assert(p != z);
+    if (MAX(p) < size)
+      NODE(arena, p)->max = size | (NODE(arena, p)->max & RED);
+    link = (z < p) ? &LEFT(p) : &RIGHT(p);
+  }
+
+  *link = z;
+  *NODE(arena, z) = (mb_node_t){.parent = p, .max = size | RED};
+  tree_insert_fixup(arena, z);
+}
+
+void freeidx_insert_after(arena_t *arena, __unused block_t *prev, block_t *block) {
+  freeidx_insert(arena, block);
+}
+
+void freeidx_remove(arena_t *arena, block_t *block) {
+  uint32_t z = OFFSET(arena, block);
+  uint32_t x, p;
+  bool red = IS_RED(z);
+
+  if (LEFT(z) == 0) {
+    x = RIGHT(z);
+    p = PARENT(z);
+    tree_transplant(arena, z, x);
+  }
+  else if (RIGHT(z) == 0) {
+    x = LEFT(z);
+    p = PARENT(z);
+    tree_transplant(arena, z, x);
+  }
+  else {
+    /* successor 'y' takes place of 'z' */
+    uint32_t y = tree_minimum(arena, RIGHT(z));
+    red = IS_RED(y);
+    x = RIGHT(y);
+
+    if (PARENT(y) == z) {
+      p = y;
+    }
+    else {
+      p = PARENT(y);
+      tree_transplant(arena, y, x);
+      RIGHT(y) = RIGHT(z);
+      PARENT(RIGHT(y)) = y;
+    }
+
+    tree_transplant(arena, z, y);
+    LEFT(y) = LEFT(z);
+    PARENT(LEFT(y)) = y;
+    NODE(arena, y)->max = (NODE(arena, y)->max & ~RED) | (NODE(arena, z)->max & RED);
+  }
+
+  tree_fix_max_up(arena, p);
+
+  if (!red)
+    tree_remove_fixup(arena, x, p);
+}
+
+void freeidx_replace(arena_t *arena, block_t *old, block_t *block) {
+  uint32_t o = OFFSET(arena, old);
+  uint32_t z = OFFSET(arena, block);
+
+  *NODE(arena, z) = *NODE(arena, o);
+  tree_transplant(arena, o, z);
+  if (LEFT(z))
+    PARENT(LEFT(z)) = z;
+  if (RIGHT(z))
+    PARENT(RIGHT(z)) = z;
+
+  tree_fix_max_up(arena, z);
+}
+
+void freeidx_update(arena_t *arena, block_t *block) {
+  tree_fix_max_up(arena, OFFSET(arena, block));
+}
+
+block_t *freeidx_find(arena_t *arena, size_t alignment, size_t size) {
+  uint32_t root = arena->freeblks.root;
+  uint32_t need, x = 0;
+
+  if (size > ARENA_MAXSIZE)
+    return NULL;
+
+  need = BLOCK_REQUIRED_DATA_SIZE(size);
+
+  while ((x = tree_first_fit(arena, root, x, need))) {
+    if (block_can_fit(BLK(arena, x), SIZE(x), alignment, size))
+      return BLK(arena, x);
+  }
+
+  return NULL;
+}
+
+block_t *freeidx_first(arena_t *arena) {
+  uint32_t root = arena->freeblks.root;
+  return root ? BLK(arena, tree_minimum(arena, root)) : NULL;
+}
+
+block_t *freeidx_next(arena_t *arena, block_t *block) {
+  uint32_t x = OFFSET(arena, block);
+
+  if (RIGHT(x))
+    return BLK(arena, tree_minimum(arena, RIGHT(x)));
+
+  uint32_t p = PARENT(x);
+  while (p && x == RIGHT(p)) {
+    x = p;
+    p = PARENT(p);
+  }
+
+  return p ? BLK(arena, p) : NULL;
+}
+
+#ifdef DEBUG
+/* Asserts order & colors of subtree of 'x' within (lo, hi), returns its
+   black height */
+static int tree_check(arena_t *arena, uint32_t x, uint32_t lo, uint32_t hi) {
+  if (x == 0)
+    return 1;
+
+  assert(lo < x && x < hi);
+  assert(BLOCK_IS_FREE(BLK(arena, x)));
+  assert(!IS_RED(x) || (!IS_RED(LEFT(x)) && !IS_RED(RIGHT(x))));
+  assert(LEFT(x) == 0 || PARENT(LEFT(x)) == x);
+  assert(RIGHT(x) == 0 || PARENT(RIGHT(x)) == x);
+  assert(MAX(x) == max(SIZE(x), max(MAX(LEFT(x)), MAX(RIGHT(x)))));
+
+  int height = tree_check(arena, LEFT(x), lo, x);
+  assert(height == tree_check(arena, RIGHT(x), x, hi));
+
+  return height + !IS_RED(x);
+}
+
+void freeidx_check(arena_t *arena) {
+  uint32_t root = arena->freeblks.root;
+
+  assert(!IS_RED(root));
+  assert(root == 0 || PARENT(root) == 0);
+  tree_check(arena, root, 0, UINT32_MAX);
+}
+#endif
+
+#else
+
+/*
+ * Dense arrays of offsets & sizes, kept in memory mapped aside from arena.
+ * Free blocks are at least BLOCK_REQUIRED_MIN_SIZE long, which bounds their
+ * number, so arrays never have to grow. Untouched pages don't cost anything.
+ */
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+#define FREEIDX_OFFSET(arena, block) \
+  ((uint32_t)((void *)(block) - (void *)(arena)))
+
+#define FREEIDX_BLOCK(arena, offset) \
+  ((block_t *)((void *)(arena) + (offset)))
+
+#define FREEIDX_MAPSIZE(capacity) \
+  (pagealign(2 * (capacity) * sizeof(uint32_t)))
+
+bool freeidx_init(arena_t *arena) {
+  mb_index_t *idx = &arena->freeblks;
+  uint32_t capacity = arena->size / BLOCK_REQUIRED_MIN_SIZE;
+
+  /* index sits on the same node as arena it indexes */
+  if ((idx->offset = get_memory(FREEIDX_MAPSIZE(capacity), arena->node))
+      == NULL)
+    return false;
+
+  idx->size = idx->offset + capacity;
+  idx->count = 0;
+  idx->capacity = capacity;
+  return true;
+}
+
+void freeidx_destroy(arena_t *arena) {
+  mb_index_t *idx = &arena->freeblks;
+
+  if (put_memory(idx->offset, FREEIDX_MAPSIZE(idx->capacity)) < 0) {
+    debug("munmap failed in free index destruction");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Returns position of the first entry not below 'block' */
+static uint32_t freeidx_position(arena_t *arena, block_t *block) {
+  mb_index_t *idx = &arena->freeblks;
+  uint32_t offset = FREEIDX_OFFSET(arena, block);
+  uint32_t lo = 0, hi = idx->count;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (idx->offset[mid] < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static uint32_t freeidx_lookup(arena_t *arena, block_t *block) {
+  uint32_t pos = freeidx_position(arena, block);
+  assert(pos < arena->freeblks.count);
+  assert(arena->freeblks.offset[pos] == FREEIDX_OFFSET(arena, block));
+  return pos;
+}
+
+static void freeidx_insert_at(arena_t *arena, uint32_t pos, block_t *block) {
+  mb_index_t *idx = &arena->freeblks;
+  uint32_t n = idx->count - pos;
+
+  assert(idx->count < idx->capacity);
+
+  memmove(&idx->offset[pos + 1], &idx->offset[pos], n * sizeof(uint32_t));
+  memmove(&idx->size[pos + 1], &idx->size[pos], n * sizeof(uint32_t));
+  idx->offset[pos] = FREEIDX_OFFSET(arena, block);
+  idx->size[pos] = BLOCK_SIZE(block);
+  idx->count++;
+}
+
+void freeidx_insert(arena_t *arena, block_t *block) {
+  assert_free_block(block);
+  freeidx_insert_at(arena, freeidx_position(arena, block), block);
+}
+
+void freeidx_insert_after(arena_t *arena, block_t *prev, block_t *block) {
+  freeidx_insert_at(arena, freeidx_lookup(arena, prev) + 1, block);
+}
+
+void freeidx_remove(arena_t *arena, block_t *block) {
+  mb_index_t *idx = &arena->freeblks;
+  uint32_t pos = freeidx_lookup(arena, block);
+  uint32_t n = idx->count - pos - 1;
+
+  memmove(&idx->offset[pos], &idx->offset[pos + 1], n * sizeof(uint32_t));
+  memmove(&idx->size[pos], &idx->size[pos + 1], n * sizeof(uint32_t));
+  idx->count--;
+}
+
+void freeidx_replace(arena_t *arena, block_t *old, block_t *block) {
+  mb_index_t *idx = &arena->freeblks;
+  uint32_t pos = freeidx_lookup(arena, old);
+
+  idx->offset[pos] = FREEIDX_OFFSET(arena, block);
+  idx->size[pos] = BLOCK_SIZE(block);
+}
+
+void freeidx_update(arena_t *arena, block_t *block) {
+  arena->freeblks.size[freeidx_lookup(arena, block)] = BLOCK_SIZE(block);
+}
+
+/*
+ * Only sizes are scanned, four at a time. A block can't fit unless its size
+ * is at least what's needed without padding, so only such candidates are
+ * checked for alignment, which needs nothing but their address.
+ */
+block_t *freeidx_find(arena_t *arena, size_t alignment, size_t size) {
+  mb_index_t *idx = &arena->freeblks;
+  uint32_t need = BLOCK_REQUIRED_DATA_SIZE(size);
+  uint32_t i = 0;
+
+  if (size > UINT32_MAX)
+    return NULL;
+
+  for (;;) {
+    for (; i + 4 <= idx->count; i += 4) {
+      v4u32 sizes;
+      memcpy(&sizes, &idx->size[i], sizeof(sizes));
+      v4u32 fits = (v4u32)(sizes >= need);
+      if (fits[0] | fits[1] | fits[2] | fits[3])
+        break;
+    }
+
+    for (uint32_t end = min(i + 4, idx->count); i < end; i++) {
+      block_t *block = FREEIDX_BLOCK(arena, idx->offset[i]);
+      if (idx->size[i] >= need && block_can_fit(block, idx->size[i], alignment, size))
+        return block;
+    }
+
+    if (i >= idx->count)
+      return NULL;
+  }
+}
+
+block_t *freeidx_first(arena_t *arena) {
+  mb_index_t *idx = &arena->freeblks;
+  return idx->count ? FREEIDX_BLOCK(arena, idx->offset[0]) : NULL;
+}
+
+block_t *freeidx_next(arena_t *arena, block_t *block) {
+  mb_index_t *idx = &arena->freeblks;
+  uint32_t pos = freeidx_lookup(arena, block) + 1;
+  return pos < idx->count ? FREEIDX_BLOCK(arena, idx->offset[pos]) : NULL;
+}
+
+#ifdef DEBUG
+void freeidx_check(arena_t *arena) {
+  mb_index_t *idx = &arena->freeblks;
+
+  assert(idx->count <= idx->capacity);
+
+  for (uint32_t i = 0; i < idx->count; i++) {
+    assert(i == 0 || idx->offset[i - 1] < idx->offset[i]);
+    assert(BLOCK_IS_FREE(FREEIDX_BLOCK(arena, idx->offset[i])));
+    assert(idx->size[i] == BLOCK_SIZE(FREEIDX_BLOCK(arena, idx->offset[i])));
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+/*
+ * Free blocks of small arena ordered by address. Blocks are looked up
+ * with address ordered first fit. Whenever size of free block changes,
+ * index has to be told with freeidx_update.
+ */
+
+bool freeidx_init(arena_t *arena);
+void freeidx_destroy(arena_t *arena);
+void freeidx_insert(arena_t *arena, block_t *block);
+void freeidx_insert_after(arena_t *arena, block_t *prev, block_t *block);
+void freeidx_remove(arena_t *arena, block_t *block);
+void freeidx_replace(arena_t *arena, block_t *old, block_t *block);
+void freeidx_update(arena_t *arena, block_t *block);
+block_t *freeidx_find(arena_t *arena, size_t alignment, size_t size);
+block_t *freeidx_first(arena_t *arena);
+block_t *freeidx_next(arena_t *arena, block_t *block);
+
+/* Asserts index is in order & agrees with blocks, only built with DEBUG */
+void freeidx_check(arena_t *arena);
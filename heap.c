@@ -0,0 +1,123 @@
+#include "heap.h"
+#include "prof.h"
+
+#define HEAP_LOCK(heap)                                                        \
+  do {                                                                         \
+    int status;                                                                \
+    if ((status = pthread_mutex_lock(&(heap)->mtx))) {                         \
+      debug("Failed to lock heap. %s", strerror(status));                      \
+      assert(false);                                                           \
+    }                                                                          \
+  } while (0)
+
+#define HEAP_UNLOCK(heap)                                                      \
+  do {                                                                         \
+    int status;                                                                \
+    if ((status = pthread_mutex_unlock(&(heap)->mtx))) {                       \
+      debug("Failed to unlock heap. %s", strerror(status));                    \
+      assert(false);                                                           \
+    }                                                                          \
+  } while (0)
+
+heap_t *heap_create(void) {
+  heap_t *heap;
+
+  if ((heap = malloc(sizeof(heap_t))) == NULL)
+    return NULL;
+
+  pthread_mutex_init(&heap->mtx, NULL);
+  LIST_INIT(&heap->small);
+  LIST_INIT(&heap->big);
+  LIST_INIT(&heap->page);
+  for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++)
+    LIST_INIT(&heap->aligned[i]);
+  heap->arenas.small = &heap->small;
+  heap->arenas.big = &heap->big;
+  heap->arenas.page = &heap->page;
+  heap->arenas.aligned = heap->aligned;
+  /* heaps aren't purged, so they don't cache big mappings either */
+  heap->arenas.cached = NULL;
+  /* every call is serialized by heap lock, threads don't own its arenas */
+  heap->arenas.shared = true;
+
+  debug("%s() = %p", __func__, heap);
+  return heap;
+}
+
+void *heap_malloc(heap_t *heap, size_t size) {
+  if (size == 0)
+    return NULL;
+
+  void *ptr;
+  int stage = 0;
+
+  do {
+    HEAP_LOCK(heap);
+    ptr = arenas_allocate(heap->arenas, BLOCK_ALIGNMENT, size);
+    HEAP_UNLOCK(heap);
+  } while (ptr == NULL && __malloc_relieve(size, &stage));
+
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  PROF_ALLOC(ptr, size);
+  return ptr;
+}
+
+void heap_free(heap_t *heap, void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  arena_t *arena;
+
+  PROF_FREE(ptr);
+
+  HEAP_LOCK(heap);
+
+  if ((arena = arena_validate_ptr(heap->arenas, ptr)) == NULL) {
+    debug("Invalid ptr = %p, doesn't belong to heap %p", ptr, heap);
+    exit(EXIT_FAILURE);
+  }
+
+  arenas_deallocate(heap->arenas, arena, ptr);
+
+  HEAP_UNLOCK(heap);
+}
+
+static bool heap_owns(void *ptr, void *arg) {
+  heap_t *heap = arg;
+  return arena_validate_ptr(heap->arenas, ptr) != NULL;
+}
+
+void heap_destroy(heap_t *heap) {
+  debug("%s(%p)", __func__, heap);
+  arena_t *arena;
+
+  if (heap == NULL)
+    return;
+
+  /* nobody is allowed to use heap at this point, so no locking here */
+  /* samples of memory we unmap would stay live and block the profiler */
+  prof_free_matching(heap_owns, heap);
+
+  while ((arena = LIST_FIRST(&heap->small)))
+    arena_small_deallocate(arena);
+
+  /* like big ones, page & aligned arenas are single mappings */
+  while ((arena = LIST_FIRST(&heap->big)) || (arena = LIST_FIRST(&heap->page))) {
+    LIST_REMOVE(arena, link);
+    arena_big_deallocate(arena);
+  }
+
+  for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++) {
+    while ((arena = LIST_FIRST(&heap->aligned[i]))) {
+      LIST_REMOVE(arena, link);
+      arena_big_deallocate(arena);
+    }
+  }
+
+  pthread_mutex_destroy(&heap->mtx);
+  free(heap);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "malloc.h"
+#include "malloc_ext.h"
+#include "structs.h"
+#include "arena.h"
+
+/*
+ * Private heap has its own set of arenas and its own lock, completely
+ * separate from the ones used by malloc & friends. Pointers never migrate
+ * between heaps, so whole heap can be released by unmapping its arenas.
+ */
+struct heap {
+  pthread_mutex_t mtx;
+  arenas_t arenas;
+  ma_list_t small;
+  ma_list_t big;
+  ma_list_t page;
+  ma_list_t aligned[ARENA_ALIGNED_CLASSES];
+};
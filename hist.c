@@ -0,0 +1,181 @@
+#include "hist.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#ifdef HISTOGRAMS
+
+typedef struct hist {
+  struct hist *next;
+  bool used;
+  uint64_t count[MALLOC_LAT_NOPS][HIST_NBUCKETS];
+} hist_t;
+
+static const char *hist_names[MALLOC_LAT_NOPS] = {
+  [MALLOC_LAT_MEMALIGN] = "memalign",
+  [MALLOC_LAT_FREE] = "free",
+  [MALLOC_LAT_REALLOC] = "realloc",
+  [MALLOC_LAT_CALLOC] = "calloc",
+  [MALLOC_LAT_LOCK_WAIT] = "lock wait",
+  [MALLOC_LAT_MMAP] = "mmap",
+  [MALLOC_LAT_MUNMAP] = "munmap",
+};
+
+/* Histograms of all threads, never freed but reused after thread exits */
+static hist_t *hist_all = NULL;
+
+static __thread hist_t *hist_self __initial_exec = NULL;
+
+static size_t hist_bucket(uint64_t ns) {
+  if (ns < HIST_LINEAR)
+    return ns;
+
+  int e = 63 - __builtin_clzll(ns);
+  size_t sub = (ns >> (e - HIST_SUBBITS)) & (HIST_SUBBUCKETS - 1);
+
+  return HIST_LINEAR + (e - 4) * HIST_SUBBUCKETS + sub;
+}
+
+/* Returns lower bound of bucket in nanoseconds */
+static uint64_t hist_bucket_bound(size_t i) {
+  if (i < HIST_LINEAR)
+    return i;
+
+  i -= HIST_LINEAR;
+  int e = i / HIST_SUBBUCKETS + 4;
+  uint64_t sub = i % HIST_SUBBUCKETS;
+
+  return (1ULL << e) + (sub << (e - HIST_SUBBITS));
+}
+
+static pthread_key_t hist_key;
+static pthread_once_t hist_once = PTHREAD_ONCE_INIT;
+
+static void hist_release(void *hist) {
+  __atomic_store_n(&((hist_t *)hist)->used, false, __ATOMIC_RELEASE);
+}
+
+static void hist_key_create(void) {
+  pthread_key_create(&hist_key, hist_release);
+}
+
+static hist_t *hist_get(void) {
+  hist_t *hist;
+
+  if (__likely(hist_self != NULL))
+    return hist_self;
+
+  /* take over histograms of a thread that already exited, if any */
+  for (hist = __atomic_load_n(&hist_all, __ATOMIC_ACQUIRE); hist; hist = hist->next) {
+    bool used = false;
+    if (__atomic_compare_exchange_n(&hist->used, &used, true, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (hist == NULL) {
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if ((hist = mmap(NULL, sizeof(hist_t), prot, flags, -1, 0)) == MAP_FAILED)
+      return NULL;
+
+    hist->used = true;
+    hist->next = __atomic_load_n(&hist_all, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&hist_all, &hist->next, hist, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  hist_self = hist;
+
+  /* pthread_setspecific may allocate, so hist_self must be set already */
+  pthread_once(&hist_once, hist_key_create);
+  pthread_setspecific(hist_key, hist);
+
+  return hist;
+}
+
+uint64_t hist_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Registering thread's histograms may allocate memory, so it's done when
+ * measurement begins. Thread's first measurement is always wait for LOCK,
+ * so it happens before the lock is taken.
+ */
+uint64_t hist_begin(void) {
+  hist_get();
+  return hist_now();
+}
+
+void hist_record(int op, uint64_t ns) {
+  hist_t *hist;
+
+  if ((hist = hist_get()) == NULL)
+    return;
+
+  /* only this thread writes, relaxed store keeps concurrent readers sane */
+  uint64_t *count = &hist->count[op][hist_bucket(ns)];
+  __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(int op, uint64_t *counts) {
+  hist_t *hist = __atomic_load_n(&hist_all, __ATOMIC_ACQUIRE);
+
+  for (; hist; hist = hist->next)
+    for (size_t i = 0; i < HIST_NBUCKETS; i++)
+      counts[i] += __atomic_load_n(&hist->count[op][i], __ATOMIC_RELAXED);
+}
+
+void hist_print(int fd) {
+  uint64_t counts[HIST_NBUCKETS];
+
+  for (int op = 0; op < MALLOC_LAT_NOPS; op++) {
+    uint64_t total = 0;
+
+    memset(counts, 0, sizeof(counts));
+    hist_merge(op, counts);
+
+    for (size_t i = 0; i < HIST_NBUCKETS; i++)
+      total += counts[i];
+
+    dprintf(fd, "%s: %lu calls\n", hist_names[op], total);
+
+    for (size_t i = 0; i < HIST_NBUCKETS; i++) {
+      if (counts[i] == 0)
+        continue;
+      dprintf(fd, "  >= %10lu ns: %lu\n", hist_bucket_bound(i), counts[i]);
+    }
+  }
+}
+
+size_t malloc_latency_histogram(int op, uint64_t *counts, uint64_t *bounds, size_t n) {
+  uint64_t all[HIST_NBUCKETS] = {};
+
+  if (op < 0 || op >= MALLOC_LAT_NOPS)
+    return 0;
+
+  hist_merge(op, all);
+
+  n = min(n, (size_t)HIST_NBUCKETS);
+  for (size_t i = 0; i < n; i++) {
+    counts[i] = all[i];
+    if (bounds)
+      bounds[i] = hist_bucket_bound(i);
+  }
+
+  return n;
+}
+
+#else
+
+size_t malloc_latency_histogram(__unused int op, __unused uint64_t *counts,
+                                __unused uint64_t *bounds, __unused size_t n) {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "malloc.h"
+#include "malloc_ext.h"
+
+/*
+ * Latency histograms, compiled in only with HISTOGRAMS defined.
+ *
+ * Buckets are log-linear: values below HIST_LINEAR nanoseconds get bucket
+ * of their own, above that each power of two is split in HIST_SUBBUCKETS
+ * equal parts. Every thread records into its own histograms, which are
+ * summed up only when someone reads them, so recording is contention free.
+ */
+
+#define HIST_LINEAR 16
+#define HIST_SUBBITS 2
+#define HIST_SUBBUCKETS (1 << HIST_SUBBITS)
+#define HIST_NBUCKETS (HIST_LINEAR + (64 - 4) * HIST_SUBBUCKETS)
+
+#ifdef HISTOGRAMS
+
+uint64_t hist_now(void);
+uint64_t hist_begin(void);
+void hist_record(int op, uint64_t ns);
+void hist_print(int fd);
+
+#define HIST_BEGIN(t) uint64_t t = hist_begin()
+#define HIST_END(op, t) hist_record((op), hist_now() - (t))
+
+#else
+
+#define HIST_BEGIN(t)
+#define HIST_END(op, t)
+
+#endif
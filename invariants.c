@@ -1,17 +1,22 @@
 #include "invariants.h"
+#include "freeidx.h"
 
 void assert_allocated_block(block_t *block) {
+  __unused block_t *next = BLOCK_NEXT(block);
+
   assert(BLOCK_IS_ALLOCATED(block));
   assert(aligned(block->data, BLOCK_ALIGNMENT));
-  assert(block->size == BLOCK_TAG(block));
-  assert(block == BLOCK_FROM_TAG_PTR(BLOCK_TAG_PTR(block)));
+  assert(next == NULL || !(BLOCK_FLAGS(next) & BLOCK_PREV_FREE));
 }
 
 void assert_free_block(block_t *block) {
+  __unused block_t *next = BLOCK_NEXT(block);
+
   assert(BLOCK_IS_FREE(block));
   assert(aligned(block->data, BLOCK_ALIGNMENT));
-  assert(block->size == BLOCK_TAG(block));
+  assert((mb_tag_t)BLOCK_SIZE(block) == BLOCK_TAG(block));
   assert(block == BLOCK_FROM_TAG_PTR(BLOCK_TAG_PTR(block)));
+  assert(next == NULL || (BLOCK_FLAGS(next) & BLOCK_PREV_FREE));
 }
 
 void assert_small_arena(arena_t *arena) {
@@ -22,24 +27,21 @@ void assert_small_arena(arena_t *arena) {
   assert(ARENA_FIRST_NULL_TAG(arena) == 0);
   assert(ARENA_LAST_NULL_TAG(arena) == 0);
   assert(ARENA_PTR_IN_BOUNDS(arena, block));
+  assert(!(BLOCK_FLAGS(block) & BLOCK_PREV_FREE));
 
-  block = ARENA_SMALL_FIRST_BLOCK(arena);
-  while (BLOCK_NEXT(block) != NULL) {
-    block = BLOCK_NEXT(block);
+  for (;;) {
     BLOCK_IS_FREE(block)
       ? assert_free_block(block)
       : assert_allocated_block(block);
+    if (BLOCK_NEXT(block) == NULL)
+      break;
+    block = BLOCK_NEXT(block);
   }
-  assert(block == ARENA_SMALL_LAST_BLOCK(arena));
+  assert((void *)block + BLOCK_TOTAL_SIZE(block) == ARENA_SMALL_END(arena));
 
-  block = ARENA_SMALL_LAST_BLOCK(arena);
-  while (BLOCK_PREV(block) != NULL) {
-    block = BLOCK_PREV(block);
-    BLOCK_IS_FREE(block)
-      ? assert_free_block(block)
-      : assert_allocated_block(block);
-  }
-  assert(block == ARENA_SMALL_FIRST_BLOCK(arena));
+#ifdef DEBUG
+  freeidx_check(arena);
+#endif
 }
 
 void assert_small_new_arena(arena_t *arena) {
@@ -47,8 +49,7 @@ void assert_small_new_arena(arena_t *arena) {
 
   assert_small_arena(arena);
 
-  assert(LIST_FIRST(&arena->freeblks) == block);
-  assert(block->size == *ARENA_SMALL_LAST_BLOCK_TAG_PTR(arena));
+  assert(freeidx_first(arena) == block);
   assert_free_block(block);
   assert(ARENA_EMPTY(arena));
 }
@@ -60,3 +61,34 @@ void assert_big_arena(arena_t *arena, size_t alignment, size_t size) {
   assert(arena->datasize >= size);
   assert(ARENA_PTR_IN_BOUNDS(arena, arena->data));
 }
+
+void assert_page_arena(arena_t *arena) {
+  uint8_t *map = ARENA_PAGE_MAP(arena);
+  size_t used = 0;
+
+  assert(arena->kind == PAGE);
+  assert(pagealigned(arena));
+  assert(ARENA_HEADER_SIZE + arena->npages <= (size_t)getpagesize());
+
+  for (size_t i = 0; i < arena->npages; i++) {
+    if (map[i] == ARENA_PAGE_FREE)
+      continue;
+    assert(map[i] != ARENA_PAGE_INNER);
+    for (size_t j = 1; j < map[i]; j++)
+      assert(map[i + j] == ARENA_PAGE_INNER);
+    used += map[i];
+    i += map[i] - 1;
+  }
+
+  assert(used == arena->usedpages);
+}
+
+void assert_aligned_slot(arena_t *arena, __unused void *slot) {
+  __unused size_t size = ARENA_ALIGNED_SLOT_SIZE(arena);
+
+  assert(arena->kind == ALIGNED);
+  assert(arena->usedslots <= arena->fresh);
+  assert(arena->fresh <= arena->nslots);
+  assert(aligned(slot, ARENA_ALIGNED_SLOT_ALIGNMENT(size)));
+  assert(slot + size <= (void *)arena + arena->size);
+}
@@ -5,4 +5,6 @@ void assert_free_block(block_t *block);
 void assert_allocated_block(block_t *block);
 void assert_small_arena(arena_t *arena);
 void assert_small_new_arena(arena_t *arena);
+void assert_page_arena(arena_t *arena);
+void assert_aligned_slot(arena_t *arena, void *slot);
 void assert_big_arena(arena_t *arena, size_t alignment, size_t size);
@@ -1,51 +1,376 @@
 #include "malloc.h"
+#include "malloc_ext.h"
 #include "arena.h"
 #include "block.h"
+#include "quick.h"
 #include "invariants.h"
+#include "prof.h"
+#include "hist.h"
+#include "trace.h"
 
 #include <sys/queue.h>
 #include <pthread.h>
 #include <stddef.h>
+#include <time.h>
 
-void *__my_memalign(size_t alignment, size_t size);
-void *__my_realloc(void *ptr, size_t size);
-void __my_free(void *ptr);
+static void *do_memalign(size_t alignment, size_t size);
+static void do_free(void *ptr);
+static void thread_register(void);
 
-#define LOCK() if ((status = pthread_mutex_lock(&mtx))) { debug("Failed to lock. %s", strerror(status)); assert(false); }
+#define LOCK() { if (__unlikely(!thread_registered)) thread_register(); HIST_BEGIN(__lock_start); if ((status = pthread_mutex_lock(&mtx))) { debug("Failed to lock. %s", strerror(status)); assert(false); } HIST_END(MALLOC_LAT_LOCK_WAIT, __lock_start); }
 #define UNLOCK() if ((status = pthread_mutex_unlock(&mtx))) { debug("Failed to unlock. %s", strerror(status)); assert(false); }
 
 static int status;
 
 static pthread_mutex_t mtx;
 
+static pthread_key_t thread_key;
+static bool thread_key_ready = false;
+static __thread bool thread_registered __initial_exec = false;
+
 static arenas_t arenas = {
   .small = &(ma_list_t){},
-  .big = &(ma_list_t){}
+  .big = &(ma_list_t){},
+  .page = &(ma_list_t){},
+  .aligned = (ma_list_t[ARENA_ALIGNED_CLASSES]){},
+  .cached = &(ma_list_t){}
 };
 
+/*
+ * Background purging, see arena.h. Purge thread sleeps on 'purge_cond'
+ * for a step of decay time, or until settings change.
+ */
+static pthread_mutex_t purge_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t purge_cond;
+static pthread_t purge_thread;
+static bool purge_started = false;
+static uint64_t purge_decay_ms = 0;
+
+/* Warm thread keeps warm pool of arenas full, see arena.c */
+static bool warm_started = false;
+
+/* Called when heap limit is hit & trimming didn't help, see malloc_ext.h */
+static malloc_pressure_t pressure_callback = NULL;
+static void *pressure_arg = NULL;
+static __thread bool pressure_busy __initial_exec = false;
+static size_t limit_failures = 0;
+
+/* Runs when thread that called us exits, see thread_register */
+static void thread_exit(__unused void *arg) {
+  LOCK();
+  arenas_orphan(arenas);
+  UNLOCK();
+  thread_registered = false;
+}
+
+/*
+ * Makes thread_exit run when calling thread exits, so its arenas don't
+ * leak. Called before taking the lock, pthread_setspecific may allocate.
+ */
+static void thread_register(void) {
+  if (!thread_key_ready)
+    return;
+
+  thread_registered = true;
+  pthread_setspecific(thread_key, (void *)1);
+}
+
+/*
+ * Purges arenas left alone for decay time, or all freed to if 'all' is set.
+ * Memory is lent by arenas under the lock & released without it, so the
+ * syscalls don't hold up anybody. Returns number of bytes released.
+ */
+static size_t purge(bool all) {
+  arena_purge_t lent[ARENA_PURGE_BATCH];
+  size_t n, bytes = 0;
+
+  for (;;) {
+    LOCK();
+    n = arenas_purge_take(arenas, all, lent, ARENA_PURGE_BATCH);
+    UNLOCK();
+
+    if (n == 0)
+      return bytes;
+
+    for (size_t i = 0; i < n; i++) {
+      arena_purge_release(&lent[i]);
+      bytes += lent[i].len;
+    }
+
+    LOCK();
+    arenas_purge_return(lent, n);
+    UNLOCK();
+  }
+}
+
+static void *purge_main(__unused void *arg) {
+  struct timespec deadline;
+
+  pthread_mutex_lock(&purge_mtx);
+
+  for (;;) {
+    if (purge_decay_ms == 0) {
+      pthread_cond_wait(&purge_cond, &purge_mtx);
+      continue;
+    }
+
+    uint64_t step = purge_decay_ms * 1000000 / ARENA_DECAY_STEPS;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    step += deadline.tv_nsec;
+    deadline.tv_sec += step / 1000000000;
+    deadline.tv_nsec = step % 1000000000;
+
+    /* woken up early means settings changed, so we start over */
+    if (pthread_cond_timedwait(&purge_cond, &purge_mtx, &deadline) != ETIMEDOUT)
+      continue;
+
+    pthread_mutex_unlock(&purge_mtx);
+
+    LOCK();
+    arena_epoch = arena_epoch + 1 ?: 1;
+    UNLOCK();
+    purge(false);
+
+    pthread_mutex_lock(&purge_mtx);
+  }
+
+  return NULL;
+}
+
+static void purge_cond_init(void) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&purge_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/*
+ * Nobody may hold the lock while we fork, or child would never get it.
+ * Purge thread doesn't survive fork, so child starts with purging off.
+ */
+static void purge_atfork_prepare(void) {
+  pthread_mutex_lock(&purge_mtx);
+  LOCK();
+  pthread_mutex_lock(&arena_warm_mtx);
+}
+
+static void purge_atfork_parent(void) {
+  pthread_mutex_unlock(&arena_warm_mtx);
+  UNLOCK();
+  pthread_mutex_unlock(&purge_mtx);
+}
+
+/* Child has no warm thread to keep warm pool full, so it lets it go */
+static void purge_atfork_child(void) {
+  purge_started = false;
+  purge_decay_ms = 0;
+  arena_purging = false;
+  purge_cond_init();
+  warm_started = false;
+  pthread_mutex_unlock(&arena_warm_mtx);
+  arena_warm_resize(0);
+  UNLOCK();
+  pthread_mutex_unlock(&purge_mtx);
+}
+
+/* Starts detached background thread, called with 'purge_mtx' held */
+static int start_thread(pthread_t *thread, void *(*main)(void *)) {
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int error = pthread_create(thread, &attr, main, NULL);
+  pthread_attr_destroy(&attr);
+
+  return error;
+}
+
+int __my_malloc_set_purge_decay(uint64_t ms) {
+  debug("%s(%lu)", __func__, ms);
+
+  pthread_mutex_lock(&purge_mtx);
+
+  if (ms > 0 && !purge_started) {
+    int error = start_thread(&purge_thread, purge_main);
+    if (error) {
+      pthread_mutex_unlock(&purge_mtx);
+      errno = error;
+      return -1;
+    }
+    purge_started = true;
+  }
+
+  purge_decay_ms = ms;
+  pthread_cond_signal(&purge_cond);
+  pthread_mutex_unlock(&purge_mtx);
+
+  LOCK();
+  arena_purging = ms > 0;
+  UNLOCK();
+
+  /* cached mappings would stay around forever */
+  if (ms == 0)
+    purge(true);
+
+  return 0;
+}
+
+static void *warm_main(__unused void *arg) {
+  for (;;) {
+    while (sem_wait(&arena_warm_sem) < 0)
+      ;
+    while (arena_warm_refill())
+      ;
+  }
+
+  return NULL;
+}
+
+int __my_malloc_set_prefault(size_t limit, size_t warm) {
+  debug("%s(%lu, %lu)", __func__, limit, warm);
+  pthread_t thread;
+
+  if (warm > ARENA_WARM_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&purge_mtx);
+
+  if (warm > 0 && !warm_started) {
+    int error = start_thread(&thread, warm_main);
+    if (error) {
+      pthread_mutex_unlock(&purge_mtx);
+      errno = error;
+      return -1;
+    }
+    warm_started = true;
+  }
+
+  __atomic_store_n(&arena_prefault, limit, __ATOMIC_RELAXED);
+  arena_warm_resize(warm);
+
+  pthread_mutex_unlock(&purge_mtx);
+
+  return 0;
+}
+
+/* Purges regardless of decay time, 'pad' isn't supported */
+int __my_malloc_trim(__unused size_t pad) {
+  return purge(true) > 0;
+}
+
+/*
+ * Called without lock after allocation of 'size' bytes failed. If it was
+ * refused because of heap limit, makes room: first by emptying warm pools
+ * & trimming, then by calling pressure callback, 'stage' tells which one
+ * is next. Returns true if allocation should be tried again.
+ */
+bool __malloc_relieve(size_t size, int *stage) {
+  malloc_pressure_t callback;
+
+  if (!arena_limited)
+    return false;
+
+  arena_limited = false;
+
+  if (*stage == 0) {
+    *stage = 1;
+    bool drained = arena_warm_drain() > 0;
+    if (purge(true) > 0 || drained)
+      return true;
+  }
+
+  /* callback may allocate, but it mustn't end up calling itself */
+  callback = __atomic_load_n(&pressure_callback, __ATOMIC_ACQUIRE);
+  if (*stage == 1 && callback && !pressure_busy) {
+    *stage = 2;
+    pressure_busy = true;
+    callback(size, pressure_arg);
+    pressure_busy = false;
+    return true;
+  }
+
+  __atomic_add_fetch(&limit_failures, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+size_t __my_malloc_set_heap_limit(size_t bytes) {
+  debug("%s(%lu)", __func__, bytes);
+  return __atomic_exchange_n(&arena_limit, bytes, __ATOMIC_RELAXED);
+}
+
+void __my_malloc_set_pressure_callback(malloc_pressure_t callback, void *arg) {
+  pressure_arg = arg;
+  __atomic_store_n(&pressure_callback, callback, __ATOMIC_RELEASE);
+}
+
+static void purge_init(void) {
+  const char *env;
+
+  if ((env = getenv("MALLOC_HEAP_LIMIT")))
+    arena_limit = strtoull(env, NULL, 0);
+
+  purge_cond_init();
+  pthread_atfork(purge_atfork_prepare, purge_atfork_parent, purge_atfork_child);
+
+  if ((env = getenv("MALLOC_PURGE_DECAY")) && strtoull(env, NULL, 0) > 0)
+    __my_malloc_set_purge_decay(strtoull(env, NULL, 0));
+
+  sem_init(&arena_warm_sem, 0, 0);
+
+  size_t limit = (env = getenv("MALLOC_PREFAULT")) ? strtoull(env, NULL, 0) : 0;
+  size_t warm = (env = getenv("MALLOC_WARM_ARENAS")) ? strtoull(env, NULL, 0) : 0;
+  if (limit > 0 || warm > 0)
+    __my_malloc_set_prefault(limit, warm);
+}
+
 __constructor void __malloc_init(void) {
   __malloc_debug_init();
+  prof_init();
 
   pthread_mutex_init(&mtx, NULL);
 
   LIST_INIT(arenas.small);
   LIST_INIT(arenas.big);
+  LIST_INIT(arenas.page);
+  for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++)
+    LIST_INIT(&arenas.aligned[i]);
+  LIST_INIT(arenas.cached);
+
+  thread_key_ready = pthread_key_create(&thread_key, thread_exit) == 0;
+
+  arena_numa_init();
+  purge_init();
+
+  /* it starts a thread, so everything else must be ready */
+  trace_init();
 }
 
 void *__my_malloc(size_t size) {
-  debug("%s(%lu)", __func__, size);
-  return __my_memalign(BLOCK_ALIGNMENT, size);
+  void *ptr = do_memalign(BLOCK_ALIGNMENT, size);
+  TRACE(TRACE_MALLOC, ptr, size, 0);
+  return ptr;
 }
 
-void *__my_realloc(void *ptr, size_t size) {
-  debug("%s(%p, %ld)", __func__, ptr, size);
-
+/* 'stamp' gets trace timestamp of successful resize, left alone otherwise */
+static void *do_realloc(void *ptr, size_t size, uint64_t *stamp) {
   if (ptr == NULL)
-    return __my_malloc(size);
+    return do_memalign(BLOCK_ALIGNMENT, size);
 
-  if (size == 0)
-    return __my_free(ptr), NULL;
+  if (size == 0) {
+    TRACE_STAMP(*stamp);
+    return do_free(ptr), NULL;
+  }
 
+  /*
+   * Resized allocation is accounted by profiler as a new one. Old sample is
+   * dropped & trace timestamp is taken once resizing succeeded, before the
+   * lock is released. So nobody reuses old address in the meantime, gets
+   * their sample dropped or is traced before us.
+   */
   arena_t *arena;
   block_t *block;
 
@@ -57,16 +382,71 @@ void *__my_realloc(void *ptr, size_t size) {
     exit(EXIT_FAILURE);
   }
 
+  /*
+   * Thread counters see realloc as release of old allocation & taking new
+   * one. If it moves, arenas_allocate & arenas_deallocate count that.
+   */
+  size_t old = arena_ptr_usable_size(arena, ptr);
+
   if (arena->kind == BIG) {
     if ((arena = arena_big_realloc(arena, size)) == NULL) {
       UNLOCK();
       errno = ENOMEM;
       return NULL;
     }
+    ARENA_DEALLOCATED(old);
+    ARENA_ALLOCATED(arena->datasize);
+    PROF_FREE(ptr);
+    TRACE_STAMP(*stamp);
     UNLOCK();
+    PROF_ALLOC(arena->data, size);
     return arena->data;
   }
 
+  if (arena->kind == PAGE) {
+    void *new = ptr;
+    if (arena_page_run_resize(arena, ptr, size)) {
+      ARENA_DEALLOCATED(old);
+      ARENA_ALLOCATED(arena_page_run_size(arena, ptr));
+    }
+    else {
+      if ((new = arenas_allocate(arenas, BLOCK_ALIGNMENT, size)) == NULL) {
+        UNLOCK();
+        errno = ENOMEM;
+        return NULL;
+      }
+      memcpy(new, ptr, old);
+      arenas_deallocate(arenas, arena, ptr);
+    }
+    PROF_FREE(ptr);
+    TRACE_STAMP(*stamp);
+    UNLOCK();
+    PROF_ALLOC(new, size);
+    return new;
+  }
+
+  if (arena->kind == ALIGNED) {
+    void *new = ptr;
+    if (size <= old) {
+      ARENA_DEALLOCATED(old);
+      ARENA_ALLOCATED(old);
+    }
+    else {
+      if ((new = arenas_allocate(arenas, BLOCK_ALIGNMENT, size)) == NULL) {
+        UNLOCK();
+        errno = ENOMEM;
+        return NULL;
+      }
+      memcpy(new, ptr, old);
+      arenas_deallocate(arenas, arena, ptr);
+    }
+    PROF_FREE(ptr);
+    TRACE_STAMP(*stamp);
+    UNLOCK();
+    PROF_ALLOC(new, size);
+    return new;
+  }
+
   /* Just in case someone tried to shrink too much */
   size = max(BLOCK_REQUIRED_DATA_MIN_SIZE, size);
 
@@ -74,36 +454,69 @@ void *__my_realloc(void *ptr, size_t size) {
   block = BLOCK_FROM_DATA_PTR(ptr);
 
   if (newkind == BIG) {
-    arena_t *new;
-    if ((new = arena_big_allocate(BLOCK_ALIGNMENT, size)) == NULL) {
+    void *new;
+    if ((new = arenas_allocate(arenas, BLOCK_ALIGNMENT, size)) == NULL) {
       UNLOCK();
       errno = ENOMEM;
       return NULL;
     }
-    memcpy(new->data, block->data, abs(block->size));
-    LIST_INSERT_HEAD(arenas.big, new, link);
-    block_deallocate(arena, block);
+    memcpy(new, block->data, old);
+    arenas_deallocate(arenas, arena, ptr);
+    PROF_FREE(ptr);
+    TRACE_STAMP(*stamp);
     UNLOCK();
-    return arena->data;
+    PROF_ALLOC(new, size);
+    return new;
   }
 
-  if ((block = arena_small_realloc(arena, block, size)) == NULL) {
+  if ((block = arena_small_realloc(arenas, arena, block, size)) == NULL) {
     UNLOCK();
     errno = ENOMEM;
     return NULL;
   }
 
+  ARENA_DEALLOCATED(old);
+  if (block->data == ptr)
+    ARENA_ALLOCATED(BLOCK_USABLE_SIZE(block));
+
+  PROF_FREE(ptr);
+  TRACE_STAMP(*stamp);
   UNLOCK();
+  PROF_ALLOC(block->data, size);
   return block->data;
 }
 
+void *__my_realloc(void *ptr, size_t size) {
+  uint64_t stamp = 0;
+  void *res;
+  int stage = 0;
+
+  HIST_BEGIN(start);
+  do
+    res = do_realloc(ptr, size, &stamp);
+  while (res == NULL && size > 0 && __malloc_relieve(size, &stage));
+  HIST_END(MALLOC_LAT_REALLOC, start);
+  TRACE_AT(stamp, TRACE_REALLOC, res, size, ptr);
+  return res;
+}
+
 void __my_free(void *ptr) {
-  debug("%s(%p)", __func__, ptr);
   if (ptr == NULL)
     return;
 
+  /* before the block is released, so it's traced before anyone reuses it */
+  TRACE(TRACE_FREE, ptr, 0, 0);
+  do_free(ptr);
+}
+
+static void do_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  PROF_FREE(ptr);
+
+  HIST_BEGIN(start);
   arena_t *arena;
-  block_t *block;
 
   LOCK();
 
@@ -112,19 +525,13 @@ void __my_free(void *ptr) {
     exit(EXIT_FAILURE);
   }
 
-  if (arena->kind == BIG) {
-    LIST_REMOVE(arena, link);
-    arena_big_deallocate(arena);
-  }
-  else {
-    block = BLOCK_FROM_DATA_PTR(ptr);
-    block_deallocate(arena, block);
-  }
+  arenas_deallocate(arenas, arena, ptr);
 
   UNLOCK();
+  HIST_END(MALLOC_LAT_FREE, start);
 }
 
-void *__my_memalign(size_t alignment, size_t size) {
+static void *do_memalign(size_t alignment, size_t size) {
   if (!powerof2(alignment) || !aligned(alignment, sizeof(void *))) {
     errno = EINVAL;
     return NULL;
@@ -133,52 +540,187 @@ void *__my_memalign(size_t alignment, size_t size) {
   if (size == 0)
     return NULL;
 
+  void *ptr;
+  int stage = 0;
+
+  alignment = max(alignment, 2 * sizeof(void *));
+
+  HIST_BEGIN(start);
+  do {
+    LOCK();
+    ptr = arenas_allocate(arenas, alignment, size);
+    UNLOCK();
+  } while (ptr == NULL && __malloc_relieve(size, &stage));
+  HIST_END(MALLOC_LAT_MEMALIGN, start);
+
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  PROF_ALLOC(ptr, size);
+  return ptr;
+}
+
+void *__my_memalign(size_t alignment, size_t size) {
+  void *ptr = do_memalign(alignment, size);
+  TRACE(TRACE_MEMALIGN, ptr, size, alignment);
+  return ptr;
+}
+
+void *__my_calloc(size_t count, size_t size) {
+  size_t bytes;
+  void *ptr = NULL;
+  int stage = 0;
+
+  if (__builtin_mul_overflow(count, size, &bytes)) {
+    errno = ENOMEM;
+    goto out;
+  }
+
+  if (bytes == 0)
+    goto out;
+
+  HIST_BEGIN(start);
+  do {
+    LOCK();
+    ptr = arenas_allocate_zero(arenas, bytes);
+    UNLOCK();
+  } while (ptr == NULL && __malloc_relieve(bytes, &stage));
+  HIST_END(MALLOC_LAT_CALLOC, start);
+
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    goto out;
+  }
+
+  PROF_ALLOC(ptr, bytes);
+
+out:
+  debug("%s(%lu, %lu) = %p", __func__, count, size, ptr);
+  TRACE(TRACE_MALLOC, ptr, bytes, 0);
+  return ptr;
+}
+
+size_t __my_malloc_batch(size_t size, size_t n, void **out) {
+  debug("%s(%lu, %lu, %p)", __func__, size, n, out);
+
+  if (size == 0)
+    return 0;
+
   arena_t *arena;
   block_t *block;
+  size_t done = 0;
 
-  alignment = max(alignment, 2 * sizeof(void *));
-  ma_kind_t kind = ARENA_WHAT_KIND_REQUIRED(alignment, size);
+  ma_kind_t kind = ARENA_WHAT_KIND_REQUIRED(BLOCK_ALIGNMENT, size);
+  uint32_t self = arena_owner();
+  int stage = 0;
 
+again:
   LOCK();
 
   if (kind == BIG) {
-    if ((arena = arena_big_allocate(alignment, size)) == NULL) {
-      UNLOCK();
-      errno = ENOMEM;
-      return NULL;
+    for (; done < n; done++) {
+      if ((arena = arena_big_allocate(BLOCK_ALIGNMENT, size)) == NULL)
+        break;
+      LIST_INSERT_HEAD(arenas.big, arena, link);
+      ARENA_ALLOCATED(arena->datasize);
+      out[done] = arena->data;
+    }
+  }
+  else {
+    while (done < n) {
+      /* carved blocks are adjacent, so they come only from our arenas,
+         or ones left on our node by exited threads, which we adopt */
+      if ((block = block_find_free(arenas.small, self, ARENA_ANY_NODE,
+                                   BLOCK_ALIGNMENT, size, &arena)) == NULL
+          && (!quick_flush_all(arenas.small, self)
+              || (block = block_find_free(arenas.small, self, ARENA_ANY_NODE,
+                                          BLOCK_ALIGNMENT, size, &arena))
+                 == NULL)
+          && (block = block_find_free(arenas.small, ARENA_NO_OWNER,
+                                      arena_node(), BLOCK_ALIGNMENT, size,
+                                      &arena)) == NULL) {
+        if ((arena = arena_small_allocate(ARENA_MAXSIZE)) == NULL)
+          break;
+        LIST_INSERT_HEAD(arenas.small, arena, link);
+        block = ARENA_SMALL_FIRST_BLOCK(arena);
+      }
+      arena->owner = self;
+      size_t carved = block_free_carve(arena, block, size, n - done, out + done);
+      for (; carved > 0; carved--, done++)
+        ARENA_ALLOCATED(BLOCK_USABLE_SIZE(BLOCK_FROM_DATA_PTR(out[done])));
     }
-    LIST_INSERT_HEAD(arenas.big, arena, link);
-    UNLOCK();
-    return arena->data;
   }
 
-  assert(kind == SMALL);
+  UNLOCK();
 
-  /* To maintain invariant, we align size to double machine word */
-  size = align(size, BLOCK_ALIGNMENT);
+  if (done < n && __malloc_relieve(size * (n - done), &stage))
+    goto again;
 
-  if ((block = block_find_free(arenas.small, alignment, size)) == NULL) {
-    if ((arena = arena_small_allocate(ARENA_MAXSIZE)) == NULL) {
-      UNLOCK();
-      errno = ENOMEM;
-      return NULL;
-    }
-    LIST_INSERT_HEAD(arenas.small, arena, link);
-    block = ARENA_SMALL_FIRST_BLOCK(arena);
+  for (size_t i = 0; i < done; i++) {
+    PROF_ALLOC(out[i], size);
+    TRACE(TRACE_MALLOC, out[i], size, 0);
   }
 
-  block = block_free_extract(block, alignment, size);
-  LIST_REMOVE(block, link);
-  BLOCK_SET_ALLOCATED(block);
+  if (done < n)
+    errno = ENOMEM;
+
+  return done;
+}
+
+static int ptr_compare(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)*(void **)a;
+  uintptr_t y = (uintptr_t)*(void **)b;
+  return (x > y) - (x < y);
+}
+
+void __my_free_batch(void **ptrs, size_t n) {
+  debug("%s(%p, %lu)", __func__, ptrs, n);
+
+  arena_t *arena = NULL;
+
+  /*
+   * Freeing in address order means block being freed usually follows
+   * the previous one, so it merges with it without free list traversal.
+   */
+  qsort(ptrs, n, sizeof(void *), ptr_compare);
+
+  for (size_t i = 0; i < n; i++) {
+    if (ptrs[i] == NULL)
+      continue;
+    PROF_FREE(ptrs[i]);
+    TRACE(TRACE_FREE, ptrs[i], 0, 0);
+  }
+
+  LOCK();
+
+  for (size_t i = 0; i < n; i++) {
+    void *ptr = ptrs[i];
+
+    if (ptr == NULL)
+      continue;
+
+    /* consecutive pointers most likely belong to the same arena */
+    if (arena == NULL || !ARENA_PTR_IN_BOUNDS(arena, ptr)) {
+      if ((arena = arena_validate_ptr(arenas, ptr)) == NULL) {
+        debug("Invalid ptr = %p, out of bands.", ptr);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    /* BIG arena gets unmapped, so we must not look at it afterwards */
+    bool big = arena->kind == BIG;
+    arenas_deallocate(arenas, arena, ptr);
+    if (big)
+      arena = NULL;
+  }
 
   UNLOCK();
-  return block->data;
 }
 
 size_t __my_malloc_usable_size(void *ptr) {
-  debug("%s(%p)", __func__, ptr);
   arena_t *arena;
-  block_t *block;
   size_t usable_size;
 
   LOCK();
@@ -189,23 +731,186 @@ size_t __my_malloc_usable_size(void *ptr) {
     exit(EXIT_FAILURE);
   }
 
-  if (arena->kind == BIG) {
-    usable_size = arena->datasize;
+  usable_size = arena_ptr_usable_size(arena, ptr);
+
+  UNLOCK();
+  return usable_size;
+}
+
+static void heap_report(struct malloc_heap_report *report, int fd) {
+  arena_t *arena;
+  char line[128];
+  int len;
+
+  memset(report, 0, sizeof(*report));
+
+  LOCK();
+
+  LIST_FOREACH(arena, arenas.small, link) {
+    size_t largest = arena_report(arena, report);
+    if (fd < 0)
+      continue;
+    /* no stdio here, it could call malloc while we hold the lock */
+    len = snprintf(line, sizeof(line), "arena %p: size %ld, largest free %lu\n",
+                   arena, arena->size, largest);
+    write(fd, line, len);
   }
-  else {
-    block = BLOCK_FROM_DATA_PTR(ptr);
-    usable_size = block->size;
+
+  LIST_FOREACH(arena, arenas.page, link)
+    arena_report(arena, report);
+
+  for (int i = 0; i < ARENA_ALIGNED_CLASSES; i++)
+    LIST_FOREACH(arena, &arenas.aligned[i], link)
+      arena_report(arena, report);
+
+  LIST_FOREACH(arena, arenas.big, link)
+    arena_report(arena, report);
+
+  LIST_FOREACH(arena, arenas.cached, link) {
+    report->mapped_bytes += arena->size;
+    report->cached_bytes += arena->size;
+    report->node_mapped_bytes[arena->node] += arena->size;
+  }
+
+  report->numa_nodes = arena_nodes;
+  for (uint32_t node = 0; node < arena_nodes; node++) {
+    size_t warm = arena_warm_bytes(node);
+    report->node_mapped_bytes[node] += warm;
+    report->warm_bytes += warm;
+  }
+  report->mapped_bytes += report->warm_bytes;
+
+  report->padding_bytes = block_padding_bytes;
+  report->padding_blocks = block_padding_blocks;
+  report->purged_bytes = arena_purged_bytes;
+  report->limit_bytes = __atomic_load_n(&arena_limit, __ATOMIC_RELAXED);
+  report->limit_mapped_bytes = __atomic_load_n(&arena_mapped, __ATOMIC_RELAXED);
+  report->limit_failures = __atomic_load_n(&limit_failures, __ATOMIC_RELAXED);
+
+  UNLOCK();
+
+  if (report->free_bytes)
+    report->fragmentation = 1.0 - (double)report->largest_free / report->free_bytes;
+}
+
+void __my_malloc_heap_report(struct malloc_heap_report *report) {
+  heap_report(report, -1);
+}
+
+void __my_malloc_heap_report_print(int fd) {
+  struct malloc_heap_report r;
+
+  heap_report(&r, fd);
+
+  dprintf(fd, "arenas: %lu small, %lu big, %lu page, %lu aligned, %lu bytes mapped\n",
+          r.small_arenas, r.big_arenas, r.page_arenas, r.aligned_arenas,
+          r.mapped_bytes);
+  dprintf(fd, "allocated: %lu bytes, %lu of them in page runs, %lu in aligned slots\n",
+          r.allocated_bytes, r.page_bytes, r.aligned_bytes);
+  dprintf(fd, "free: %lu bytes in %lu blocks, largest %lu\n",
+          r.free_bytes, r.free_blocks, r.largest_free);
+  dprintf(fd, "fragmentation: %.3f\n", r.fragmentation);
+  dprintf(fd, "padding: %lu bytes in %lu blocks\n",
+          r.padding_bytes, r.padding_blocks);
+  dprintf(fd, "purge: %lu bytes cached, %lu bytes purged\n",
+          r.cached_bytes, r.purged_bytes);
+  if (r.warm_bytes)
+    dprintf(fd, "warm: %lu bytes\n", r.warm_bytes);
+  if (r.numa_nodes > 1)
+    for (size_t node = 0; node < r.numa_nodes; node++)
+      dprintf(fd, "node %lu: %lu bytes mapped, %lu bytes allocated\n", node,
+              r.node_mapped_bytes[node], r.node_allocated_bytes[node]);
+  if (r.limit_bytes)
+    dprintf(fd, "limit: %lu of %lu bytes mapped, %lu failures\n",
+            r.limit_mapped_bytes, r.limit_bytes, r.limit_failures);
+  dprintf(fd, "occupancy: empty %lu, <=25%% %lu, <=50%% %lu, <=75%% %lu, <=100%% %lu\n",
+          r.occupancy[0], r.occupancy[1], r.occupancy[2], r.occupancy[3],
+          r.occupancy[4]);
+  dprintf(fd, "free blocks by size:\n");
+  for (int i = 0; i < MALLOC_REPORT_SIZE_BINS; i++)
+    if (r.free_histogram[i])
+      dprintf(fd, "  >= %8lu: %lu\n", BLOCK_ALIGNMENT << i, r.free_histogram[i]);
+}
+
+size_t __my_xallocx(void *ptr, size_t size, size_t extra, __unused int flags) {
+  debug("%s(%p, %lu, %lu)", __func__, ptr, size, extra);
+  arena_t *arena;
+  size_t usable_size;
+
+  LOCK();
+
+  if ((arena = arena_validate_ptr(arenas, ptr)) == NULL) {
+    debug("Invalid ptr = %p, doesn't belong to any arena", ptr);
+    exit(EXIT_FAILURE);
   }
 
+  ARENA_DEALLOCATED(arena_ptr_usable_size(arena, ptr));
+  usable_size = arena_resize_inplace(arena, ptr, size, extra);
+  ARENA_ALLOCATED(usable_size);
+
   UNLOCK();
   return usable_size;
 }
 
+size_t __my_try_realloc_inplace(void *ptr, size_t size, size_t extra) {
+  return __my_xallocx(ptr, size, extra, 0);
+}
+
+/* Counters are thread local, so they're read without taking the lock */
+uint64_t __my_thread_allocated_bytes(void) {
+  return arena_thread_allocated;
+}
+
+uint64_t __my_thread_deallocated_bytes(void) {
+  return arena_thread_deallocated;
+}
+
+uint64_t *__my_thread_allocated_bytes_ptr(void) {
+  return &arena_thread_allocated;
+}
+
+uint64_t *__my_thread_deallocated_bytes_ptr(void) {
+  return &arena_thread_deallocated;
+}
+
+size_t __my_nallocx(size_t size, int flags) {
+  size_t alignment = (size_t)1 << (flags & MALLOCX_ALIGN_MASK);
+
+  if (size == 0)
+    return 0;
+
+  alignment = max(alignment, BLOCK_ALIGNMENT);
+
+  return arena_usable_size(alignment, size);
+}
+
+size_t __my_malloc_good_size(size_t size) {
+  return __my_nallocx(size, 0);
+}
+
 /* DO NOT remove following lines */
+__strong_alias(__my_calloc, calloc);
 __strong_alias(__my_free, cfree);
 __strong_alias(__my_free, free);
+__strong_alias(__my_free_batch, free_batch);
 __strong_alias(__my_malloc, malloc);
+__strong_alias(__my_malloc_batch, malloc_batch);
+__strong_alias(__my_malloc_good_size, malloc_good_size);
+__strong_alias(__my_malloc_heap_report, malloc_heap_report);
+__strong_alias(__my_malloc_heap_report_print, malloc_heap_report_print);
+__strong_alias(__my_malloc_set_heap_limit, malloc_set_heap_limit);
+__strong_alias(__my_malloc_set_prefault, malloc_set_prefault);
+__strong_alias(__my_malloc_set_pressure_callback, malloc_set_pressure_callback);
+__strong_alias(__my_malloc_set_purge_decay, malloc_set_purge_decay);
+__strong_alias(__my_malloc_trim, malloc_trim);
 __strong_alias(__my_malloc_usable_size, malloc_usable_size);
 __strong_alias(__my_memalign, aligned_alloc);
 __strong_alias(__my_memalign, memalign);
+__strong_alias(__my_nallocx, nallocx);
 __strong_alias(__my_realloc, realloc);
+__strong_alias(__my_thread_allocated_bytes, thread_allocated_bytes);
+__strong_alias(__my_thread_allocated_bytes_ptr, thread_allocated_bytes_ptr);
+__strong_alias(__my_thread_deallocated_bytes, thread_deallocated_bytes);
+__strong_alias(__my_thread_deallocated_bytes_ptr, thread_deallocated_bytes_ptr);
+__strong_alias(__my_try_realloc_inplace, try_realloc_inplace);
+__strong_alias(__my_xallocx, xallocx);
@@ -17,6 +17,9 @@
 #define __unused __attribute__((unused))
 #define __constructor __attribute__((constructor))
 #define __format(func, str, fst) __attribute__((format(func, str, fst)))
+#define __initial_exec __attribute__((tls_model("initial-exec")))
+#define __likely(x) __builtin_expect(!!(x), 1)
+#define __unlikely(x) __builtin_expect(!!(x), 0)
 
 #define abs(x) ((x) > 0 ? x : -(x))
 #define max(x, y) ((x) > (y) ? x : y)
@@ -37,6 +40,8 @@ typedef size_t (*malloc_usable_size_t)(void *ptr);
 
 #define debug(fmt, ...) __malloc_debug(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
 
+bool __malloc_relieve(size_t size, int *stage);
+
 void __malloc_debug_init(void);
 void __malloc_debug(const char *file, int line, const char *fmt, ...)
   __format(printf, 3, 4);
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Non-standard entry points exported by malloc.so in addition to the
+ * usual malloc family. Include this header to use them.
+ */
+
+/*
+ * Allocates up to 'n' blocks of 'size' bytes each and stores them in 'out'.
+ * Returns number of blocks allocated, which is less than 'n' only if we ran
+ * out of memory (errno is set to ENOMEM then).
+ */
+size_t malloc_batch(size_t size, size_t n, void **out);
+
+/*
+ * Frees 'n' pointers from 'ptrs'. NULL entries are skipped. The array is
+ * sorted in place by address, so that adjacent blocks coalesce cheaply.
+ */
+void free_batch(void **ptrs, size_t n);
+
+/*
+ * Flags for nallocx. Alignment is passed as its base 2 logarithm in lowest
+ * 6 bits, zero means default alignment of malloc.
+ */
+#define MALLOCX_LG_ALIGN(la) ((int)(la))
+#define MALLOCX_ALIGN(a) ((int)(__builtin_ffsl(a) - 1))
+#define MALLOCX_ALIGN_MASK 0x3f
+
+/*
+ * Returns usable size of allocation malloc (or memalign with alignment passed
+ * in flags) would return for request of 'size' bytes, without allocating
+ * anything. Returns 0 if the request cannot be satisfied.
+ */
+size_t nallocx(size_t size, int flags);
+
+/* Same as nallocx(size, 0), provided for compatibility with macOS. */
+size_t malloc_good_size(size_t size);
+
+/*
+ * Resizes allocation at 'ptr' in place, so that it holds at least 'size'
+ * and if possible 'size + extra' bytes. It never moves nor copies memory,
+ * if allocation cannot grow to 'size' bytes it's left untouched.
+ * Returns usable size after resize, compare it with 'size' to see whether
+ * resizing succeeded. Flags are accepted for compatibility and ignored.
+ */
+size_t xallocx(void *ptr, size_t size, size_t extra, int flags);
+
+/* Same as xallocx(ptr, size, extra, 0). */
+size_t try_realloc_inplace(void *ptr, size_t size, size_t extra);
+
+/*
+ * Usable bytes allocated & deallocated by calling thread since it started,
+ * including private heaps. Realloc and xallocx count as release of old
+ * allocation and taking the new one, even if memory didn't move. Counters
+ * only grow and are kept in thread local storage, without atomics.
+ */
+uint64_t thread_allocated_bytes(void);
+uint64_t thread_deallocated_bytes(void);
+
+/*
+ * Same counters of calling thread, but for reading with a plain load.
+ * Pointers are valid as long as the thread lives.
+ */
+uint64_t *thread_allocated_bytes_ptr(void);
+uint64_t *thread_deallocated_bytes_ptr(void);
+
+/*
+ * Writes live sampled allocations as pprof heap profile to 'path'. If 'path'
+ * is NULL, file name is made of MALLOC_PROF_PREFIX, pid and sequence number.
+ * Profiler is enabled by setting MALLOC_PROF_SAMPLE to mean number of bytes
+ * between samples. Setting MALLOC_PROF_SIGNAL to signal number makes that
+ * signal request a dump, which is written on next sampled allocation.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int malloc_prof_dump(const char *path);
+
+/*
+ * Operations we collect latency histograms for, when malloc.so is built
+ * with HISTOGRAMS. Memalign covers malloc too. Lock wait, mmap and munmap
+ * are also part of time spent in calls they happen to be made from.
+ */
+enum {
+  MALLOC_LAT_MEMALIGN,
+  MALLOC_LAT_FREE,
+  MALLOC_LAT_REALLOC,
+  MALLOC_LAT_CALLOC,
+  MALLOC_LAT_LOCK_WAIT,
+  MALLOC_LAT_MMAP,
+  MALLOC_LAT_MUNMAP,
+  MALLOC_LAT_NOPS
+};
+
+/*
+ * Copies up to 'n' buckets of latency histogram for 'op', summed over all
+ * threads, to 'counts'. If 'bounds' isn't NULL, it gets lower bound of each
+ * bucket in nanoseconds. Returns number of buckets copied, 0 if malloc.so
+ * was built without histograms. malloc_stats prints them all to stderr.
+ */
+size_t malloc_latency_histogram(int op, uint64_t *counts, uint64_t *bounds, size_t n);
+
+#define MALLOC_REPORT_SIZE_BINS 16
+#define MALLOC_REPORT_OCCUPANCY_CLASSES 5
+#define MALLOC_REPORT_NODES 64
+
+/* Shape of the heap used by malloc & friends */
+struct malloc_heap_report {
+  size_t small_arenas;
+  size_t big_arenas;
+  size_t page_arenas;
+  size_t aligned_arenas;
+  /* bytes mapped for all arenas including their headers */
+  size_t mapped_bytes;
+  /* bytes handed out, including block tags in small arenas */
+  size_t allocated_bytes;
+  /* part of allocated bytes handed out in page runs */
+  size_t page_bytes;
+  /* part of allocated bytes handed out in slots of aligned arenas */
+  size_t aligned_bytes;
+  /* payload bytes of free blocks in small arenas */
+  size_t free_bytes;
+  size_t free_blocks;
+  size_t largest_free;
+  /* external fragmentation: 1 - largest_free / free_bytes */
+  double fragmentation;
+  /* bytes split off as alignment padding blocks, since start */
+  size_t padding_bytes;
+  size_t padding_blocks;
+  /* big mappings kept after free for reuse, part of mapped bytes */
+  size_t cached_bytes;
+  /* bytes given back to the kernel by purging, since start */
+  size_t purged_bytes;
+  /* arenas mapped ahead in warm pool, part of mapped bytes */
+  size_t warm_bytes;
+  /* heap limit (0 if none) & bytes counted against it, private heaps too */
+  size_t limit_bytes;
+  size_t limit_mapped_bytes;
+  /* allocations failed because of heap limit, since start */
+  size_t limit_failures;
+  /* free blocks by size: bin i holds sizes in [16 * 2^i, 16 * 2^(i+1)) */
+  size_t free_histogram[MALLOC_REPORT_SIZE_BINS];
+  /* small arenas by used share: empty, up to 25%, 50%, 75% and 100% */
+  size_t occupancy[MALLOC_REPORT_OCCUPANCY_CLASSES];
+  /*
+   * NUMA nodes, 1 without NUMA. Memory is bound to node of CPU it was
+   * mapped on & threads reuse arenas of their node, so every node keeps
+   * a pool of its own. Warm pools too are per node.
+   */
+  size_t numa_nodes;
+  /* parts of mapped & allocated bytes on each node */
+  size_t node_mapped_bytes[MALLOC_REPORT_NODES];
+  size_t node_allocated_bytes[MALLOC_REPORT_NODES];
+};
+
+/*
+ * Fills 'report' with current shape of the heap. It walks only free
+ * blocks, so it's cheap enough to be called periodically.
+ */
+void malloc_heap_report(struct malloc_heap_report *report);
+
+/* Writes heap report with largest free block of every arena to 'fd'. */
+void malloc_heap_report_print(int fd);
+
+/*
+ * Sets decay time of background purging: free pages of arenas nobody freed
+ * to for 'ms' milliseconds are given back to the kernel by purge thread,
+ * started on first call. Meanwhile freed big allocations are cached for
+ * reuse rather than unmapped. Zero turns purging off & releases whatever
+ * is cached. MALLOC_PURGE_DECAY sets it at startup, it's off by default.
+ * Child of fork starts with purging off. malloc_trim purges everything
+ * right away, whether purging is on or not. Returns 0 on success, -1 with
+ * errno set otherwise.
+ */
+int malloc_set_purge_decay(uint64_t ms);
+
+/*
+ * Sets prefaulting, trading memory for allocation time without page faults.
+ * Arenas & big allocations of up to 'limit' bytes are populated as they're
+ * mapped. Background thread, started on first call, keeps 'warm' populated
+ * arenas (at most 16) mapped ahead, so new small, page & aligned arenas
+ * don't wait for mmap either. MALLOC_PREFAULT & MALLOC_WARM_ARENAS set
+ * them at startup, both are 0 by default. Warm pool is counted against
+ * heap limit, malloc_trim leaves it alone, but it's emptied when the limit
+ * is hit & isn't refilled too close to it. Child of fork starts with empty
+ * warm pool. Returns 0 on success, -1 with errno set otherwise.
+ */
+int malloc_set_prefault(size_t limit, size_t warm);
+
+/*
+ * Sets soft limit on bytes mapped by malloc & private heaps, 0 removes it.
+ * Allocation that would need to map memory past the limit first empties
+ * warm pools (see malloc_set_prefault) & trims the heap (see malloc_trim),
+ * then calls pressure callback & tries again after each of them. If it's
+ * still over, it fails with ENOMEM. MALLOC_HEAP_LIMIT sets it at startup.
+ * Returns previous limit.
+ */
+size_t malloc_set_heap_limit(size_t bytes);
+
+/*
+ * Called with size of failed request, when heap limit is hit & trimming
+ * didn't help. It runs without any lock held, so it may free memory it
+ * can spare. Allocations it does itself never call it again.
+ */
+typedef void (*malloc_pressure_t)(size_t size, void *arg);
+
+void malloc_set_pressure_callback(malloc_pressure_t callback, void *arg);
+
+/*
+ * Private heaps. Memory allocated from a heap must be freed to the same heap,
+ * or all at once with heap_destroy, which unmaps every arena the heap owns.
+ */
+typedef struct heap heap_t;
+
+heap_t *heap_create(void);
+void *heap_malloc(heap_t *heap, size_t size);
+void heap_free(heap_t *heap, void *ptr);
+void heap_destroy(heap_t *heap);
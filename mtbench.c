@@ -0,0 +1,363 @@
+/*
+ * Multithreaded allocator benchmarks. Like replay, it isn't linked with
+ * malloc.so, so it measures the system allocator unless another one is
+ * preloaded. 'make bench' runs it against both.
+ *
+ * Every workload runs for a fixed time with 1, 2, 4, ... up to N threads,
+ * each run in its own process, so peak RSS of one doesn't hide the next.
+ */
+
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOTS 1024
+#define RING_SIZE 1024
+#define BATON_PERIOD 10000
+
+typedef struct worker {
+  pthread_t handle;
+  int index;
+  uint64_t rng;
+  uint64_t ops;
+  char pad[64];
+} worker_t;
+
+typedef void (*workload_fn)(worker_t *);
+
+static worker_t *workers;
+static int nworkers;
+static volatile bool stop;
+
+static inline uint64_t rnd(worker_t *w) {
+  /* xorshift64 */
+  w->rng ^= w->rng << 13;
+  w->rng ^= w->rng >> 7;
+  w->rng ^= w->rng << 17;
+  return w->rng;
+}
+
+/* Threads do their work in rounds, checking for stop between them */
+#define ROUND 64
+
+/*
+ * Larson: server-like churn of objects 16 to 512 bytes. Now and then a
+ * thread swaps its whole set of objects with whatever another thread left,
+ * so most objects end up freed by a thread that didn't allocate them.
+ */
+static void **larson_baton;
+
+static void larson(worker_t *w) {
+  void **slots = calloc(SLOTS, sizeof(void *));
+
+  while (!stop) {
+    for (int i = 0; i < ROUND; i++) {
+      int k = rnd(w) % SLOTS;
+      free(slots[k]);
+      slots[k] = malloc(16 + rnd(w) % 497);
+      *(char *)slots[k] = 1;
+    }
+    w->ops += ROUND;
+    if (w->ops % BATON_PERIOD < ROUND)
+      slots = __atomic_exchange_n(&larson_baton, slots, __ATOMIC_ACQ_REL)
+                ?: calloc(SLOTS, sizeof(void *));
+  }
+
+  for (int k = 0; k < SLOTS; k++)
+    free(slots[k]);
+  free(slots);
+}
+
+/*
+ * Producer/consumer: every thread allocates objects for the next one and
+ * frees objects coming from the previous one, through single producer
+ * single consumer rings. With one thread it frees its own objects.
+ */
+typedef struct ring {
+  void *items[RING_SIZE];
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+} ring_t;
+
+static ring_t *rings;
+
+static void prodcons(worker_t *w) {
+  ring_t *out = &rings[(w->index + 1) % nworkers];
+  ring_t *in = &rings[w->index];
+
+  while (!stop) {
+    for (int i = 0; i < ROUND; i++) {
+      void *ptr = malloc(16 + rnd(w) % 241);
+      uint64_t head = out->head;
+      if (head - __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE) < RING_SIZE) {
+        out->items[head % RING_SIZE] = ptr;
+        __atomic_store_n(&out->head, head + 1, __ATOMIC_RELEASE);
+      }
+      else {
+        free(ptr);
+      }
+
+      uint64_t tail = in->tail;
+      if (tail != __atomic_load_n(&in->head, __ATOMIC_ACQUIRE)) {
+        free(in->items[tail % RING_SIZE]);
+        __atomic_store_n(&in->tail, tail + 1, __ATOMIC_RELEASE);
+      }
+    }
+    w->ops += 2 * ROUND;
+  }
+}
+
+/*
+ * Cache-scratch: threads allocate small objects and write to them a lot.
+ * If the allocator places objects of different threads on the same cache
+ * line, they keep stealing it from each other. First object of every
+ * thread is allocated by the main thread, one after another.
+ */
+static void **scratch_initial;
+
+static void cache_scratch(worker_t *w) {
+  volatile char *obj = scratch_initial[w->index];
+
+  while (!stop) {
+    for (int i = 0; i < ROUND; i++) {
+      for (int j = 0; j < 100; j++)
+        obj[j % 8]++;
+      free((void *)obj);
+      obj = malloc(8);
+    }
+    w->ops += ROUND;
+  }
+
+  free((void *)obj);
+}
+
+/*
+ * Cache-thrash: like cache-scratch, but every thread allocates all of its
+ * objects itself. Objects allocated at the same time by different threads
+ * must not end up on the same cache line.
+ */
+static void cache_thrash(worker_t *w) {
+  while (!stop) {
+    for (int i = 0; i < ROUND; i++) {
+      volatile char *obj = malloc(8);
+      for (int j = 0; j < 100; j++)
+        obj[j % 8]++;
+      free((void *)obj);
+    }
+    w->ops += ROUND;
+  }
+}
+
+/* Random mix of mostly small objects, few of them up to 16KiB */
+static void random_mix(worker_t *w) {
+  void **slots = calloc(SLOTS * 4, sizeof(void *));
+
+  while (!stop) {
+    for (int i = 0; i < ROUND; i++) {
+      int k = rnd(w) % (SLOTS * 4);
+      uint64_t r = rnd(w);
+      size_t size = (r % 16 == 0) ? r % 16384 : 8 + r % 256;
+      free(slots[k]);
+      slots[k] = malloc(size);
+    }
+    w->ops += ROUND;
+  }
+
+  for (int k = 0; k < SLOTS * 4; k++)
+    free(slots[k]);
+  free(slots);
+}
+
+/* Buffer growing by half of its size at a time up to 8MiB, like a vector */
+static void realloc_growth(worker_t *w) {
+  while (!stop) {
+    char *buf = malloc(64);
+    for (size_t size = 64; size < 8 << 20; size += size / 2) {
+      buf = realloc(buf, size);
+      buf[size - 1] = 1;
+      w->ops++;
+    }
+    free(buf);
+  }
+}
+
+/* Churn of objects with random power of two alignment from 16 to 4096 */
+static void memalign_heavy(worker_t *w) {
+  void **slots = calloc(SLOTS, sizeof(void *));
+
+  while (!stop) {
+    for (int i = 0; i < ROUND; i++) {
+      int k = rnd(w) % SLOTS;
+      uint64_t r = rnd(w);
+      free(slots[k]);
+      slots[k] = memalign(16 << (r % 9), 16 + (r >> 8) % 2033);
+    }
+    w->ops += ROUND;
+  }
+
+  for (int k = 0; k < SLOTS; k++)
+    free(slots[k]);
+  free(slots);
+}
+
+static struct {
+  const char *name;
+  workload_fn fn;
+} workloads[] = {
+  {"larson", larson},
+  {"prodcons", prodcons},
+  {"cache-scratch", cache_scratch},
+  {"cache-thrash", cache_thrash},
+  {"random-mix", random_mix},
+  {"realloc-growth", realloc_growth},
+  {"memalign", memalign_heavy},
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static workload_fn current;
+
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+  current(w);
+  return NULL;
+}
+
+/* Runs in a child process, returns total number of operations */
+static uint64_t run(workload_fn fn, int nthreads, double seconds) {
+  nworkers = nthreads;
+  current = fn;
+  workers = calloc(nthreads, sizeof(worker_t));
+  rings = calloc(nthreads, sizeof(ring_t));
+  scratch_initial = calloc(nthreads, sizeof(void *));
+
+  for (int i = 0; i < nthreads; i++)
+    scratch_initial[i] = malloc(8);
+
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].index = i;
+    workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    pthread_create(&workers[i].handle, NULL, worker_main, &workers[i]);
+  }
+
+  struct timespec delay = {.tv_sec = seconds,
+                           .tv_nsec = (seconds - (int)seconds) * 1e9};
+  nanosleep(&delay, NULL);
+  stop = true;
+
+  uint64_t ops = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].handle, NULL);
+    ops += workers[i].ops;
+  }
+
+  return ops;
+}
+
+static void measure(int index, int nthreads, double seconds) {
+  int fds[2];
+  uint64_t ops = 0;
+  struct rusage ru;
+  int status;
+
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    ops = run(workloads[index].fn, nthreads, seconds);
+    if (write(fds[1], &ops, sizeof(ops)) != sizeof(ops))
+      _exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  bool ok = read(fds[0], &ops, sizeof(ops)) == sizeof(ops);
+  close(fds[0]);
+
+  if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0 || !ok) {
+    printf("%-16s %7d  %s\n", workloads[index].name, nthreads,
+           WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "failed");
+    return;
+  }
+
+  printf("%-16s %7d %14.0f %10ld KiB\n", workloads[index].name, nthreads,
+         ops / seconds, ru.ru_maxrss);
+  fflush(stdout);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-t max-threads] [-d seconds] [workload...]\n", prog);
+  fprintf(stderr, "Workloads:");
+  for (size_t i = 0; i < NWORKLOADS; i++)
+    fprintf(stderr, " %s", workloads[i].name);
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  double seconds = 0.5;
+  bool selected[NWORKLOADS] = {false};
+  bool any = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:d:")) != -1) {
+    switch (opt) {
+      case 't':
+        maxthreads = atoi(optarg);
+        break;
+      case 'd':
+        seconds = atof(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (maxthreads < 1 || seconds <= 0)
+    usage(argv[0]);
+
+  for (int i = optind; i < argc; i++) {
+    size_t j;
+    for (j = 0; j < NWORKLOADS; j++)
+      if (strcmp(argv[i], workloads[j].name) == 0)
+        break;
+    if (j == NWORKLOADS)
+      usage(argv[0]);
+    selected[j] = any = true;
+  }
+
+  const char *allocator = getenv("LD_PRELOAD");
+  printf("allocator: %s\n", allocator ? allocator : "system");
+  printf("%-16s %7s %14s %14s\n", "workload", "threads", "ops/s", "peak RSS");
+
+  for (size_t i = 0; i < NWORKLOADS; i++) {
+    if (any && !selected[i])
+      continue;
+    for (int n = 1; n < maxthreads; n *= 2)
+      measure(i, n, seconds);
+    measure(i, maxthreads, seconds);
+  }
+
+  return EXIT_SUCCESS;
+}
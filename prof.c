@@ -0,0 +1,327 @@
+#include "prof.h"
+#include "malloc_ext.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+/* How many frames we record for each sample */
+#define PROF_DEPTH 32
+
+/* Frames belonging to allocator itself: prof_sample & entry point */
+#define PROF_SKIP 2
+
+/* Maximum number of live samples, must be power of two */
+#define PROF_TABLE_BITS 16
+#define PROF_TABLE_SIZE (1 << PROF_TABLE_BITS)
+
+#define PROF_HASH(ptr) \
+  ((((uintptr_t)(ptr) >> 4) * 0x9e3779b97f4a7c15ULL) >> (64 - PROF_TABLE_BITS))
+
+typedef struct prof_record {
+  void *ptr;
+  size_t size;
+  int depth;
+  void *frames[PROF_DEPTH];
+} prof_record_t;
+
+__thread int64_t prof_countdown __initial_exec = 0;
+static __thread uint64_t prof_seed __initial_exec = 0;
+static __thread bool prof_busy __initial_exec = false;
+
+/* Number of records in the table, read without lock by PROF_FREE */
+size_t prof_live = 0;
+
+/* Mean number of bytes between samples, zero means profiler is disabled */
+static int64_t prof_rate = 0;
+
+/* Taken by realloc under allocator lock, so nothing under it may allocate */
+static pthread_mutex_t prof_mtx = PTHREAD_MUTEX_INITIALIZER;
+static prof_record_t *prof_table;
+
+static const char *prof_prefix = "malloc";
+static volatile sig_atomic_t prof_dump_pending = 0;
+static unsigned prof_dump_seq = 0;
+
+static void prof_signal(__unused int signo) {
+  /* Dumping here isn't async-signal-safe, so it's done on next sample. */
+  prof_dump_pending = 1;
+}
+
+void prof_init(void) {
+  const char *env;
+  int64_t rate;
+
+  if ((env = getenv("MALLOC_PROF_SAMPLE")) == NULL)
+    return;
+
+  if ((rate = strtoll(env, NULL, 0)) <= 0)
+    return;
+
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  size_t size = pagealign(PROF_TABLE_SIZE * sizeof(prof_record_t));
+  if ((prof_table = mmap(NULL, size, prot, flags, -1, 0)) == MAP_FAILED) {
+    debug("mmap failed with \"%s\"", strerror(errno));
+    prof_table = NULL;
+    return;
+  }
+
+  if ((env = getenv("MALLOC_PROF_PREFIX")))
+    prof_prefix = env;
+
+  if ((env = getenv("MALLOC_PROF_SIGNAL"))) {
+    struct sigaction sa = {.sa_handler = prof_signal, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(atoi(env), &sa, NULL);
+  }
+
+  prof_rate = rate;
+
+  /* backtrace loads libgcc on first use, which allocates memory */
+  void *frame;
+  prof_busy = true;
+  backtrace(&frame, 1);
+  prof_busy = false;
+}
+
+/*
+ * Draws number of bytes until next sample from exponential distribution
+ * with mean of 'prof_rate', which makes sampling a Poisson process.
+ * -ln(u) is computed from log2 with a quadratic approximation of mantissa,
+ * that's good enough here and saves us from depending on libm.
+ */
+static int64_t prof_next_interval(void) {
+  if (prof_seed == 0)
+    prof_seed = ((uintptr_t)&prof_seed ^ (uintptr_t)getpid()) * 0x2545f4914f6cdd1dULL | 1;
+
+  prof_seed ^= prof_seed >> 12;
+  prof_seed ^= prof_seed << 25;
+  prof_seed ^= prof_seed >> 27;
+
+  /* uniform q in [1, 2^26] */
+  uint64_t q = ((prof_seed * 0x2545f4914f6cdd1dULL) >> 38) + 1;
+  int e = 63 - __builtin_clzll(q);
+  double m = (double)q / (double)(1ULL << e) - 1.0;
+  double log2q = e + m * (1.3465 - 0.3465 * m);
+
+  return (int64_t)((26.0 - log2q) * 0.6931471805599453 * prof_rate) + 1;
+}
+
+static prof_record_t *prof_lookup(void *ptr) {
+  size_t i = PROF_HASH(ptr);
+
+  while (prof_table[i].ptr != NULL) {
+    if (prof_table[i].ptr == ptr)
+      return &prof_table[i];
+    i = (i + 1) & (PROF_TABLE_SIZE - 1);
+  }
+
+  return NULL;
+}
+
+static bool prof_insert(void *ptr, size_t size, void **frames, int depth) {
+  if (prof_live >= PROF_TABLE_SIZE / 2)
+    return false;
+
+  size_t i = PROF_HASH(ptr);
+  while (prof_table[i].ptr != NULL)
+    i = (i + 1) & (PROF_TABLE_SIZE - 1);
+
+  prof_table[i].ptr = ptr;
+  prof_table[i].size = size;
+  prof_table[i].depth = depth;
+  memcpy(prof_table[i].frames, frames, depth * sizeof(void *));
+
+  return true;
+}
+
+/* Removes record keeping linear probing chains intact (backward shift) */
+static void prof_remove(prof_record_t *record) {
+  size_t i = record - prof_table;
+  size_t j = i;
+
+  for (;;) {
+    j = (j + 1) & (PROF_TABLE_SIZE - 1);
+    if (prof_table[j].ptr == NULL)
+      break;
+    size_t k = PROF_HASH(prof_table[j].ptr);
+    /* can record at 'j' be moved to empty slot at 'i'? */
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    prof_table[i] = prof_table[j];
+    i = j;
+  }
+
+  prof_table[i].ptr = NULL;
+}
+
+static int prof_dump_locked(const char *path);
+
+void prof_sample(void *ptr, size_t size) {
+  void *frames[PROF_DEPTH + PROF_SKIP];
+  int depth;
+
+  if (prof_busy)
+    return;
+
+  if (prof_rate == 0) {
+    prof_countdown = INT64_MAX;
+    return;
+  }
+
+  /* first allocation of a thread starts the countdown & counts against it */
+  if (prof_seed == 0
+      && (prof_countdown = prof_next_interval() - (int64_t)size) >= 0)
+    return;
+
+  prof_countdown = prof_next_interval();
+
+  prof_busy = true;
+
+  depth = backtrace(frames, PROF_DEPTH + PROF_SKIP) - PROF_SKIP;
+  depth = max(depth, 0);
+
+  pthread_mutex_lock(&prof_mtx);
+  if (prof_insert(ptr, size, frames + PROF_SKIP, depth))
+    __atomic_add_fetch(&prof_live, 1, __ATOMIC_RELAXED);
+  if (prof_dump_pending) {
+    prof_dump_pending = 0;
+    prof_dump_locked(NULL);
+  }
+  pthread_mutex_unlock(&prof_mtx);
+
+  prof_busy = false;
+}
+
+void prof_free(void *ptr) {
+  prof_record_t *record;
+
+  pthread_mutex_lock(&prof_mtx);
+  if ((record = prof_lookup(ptr))) {
+    prof_remove(record);
+    __atomic_sub_fetch(&prof_live, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&prof_mtx);
+}
+
+/* Drops samples of every allocation 'match' claims, for released memory */
+void prof_free_matching(bool (*match)(void *ptr, void *arg), void *arg) {
+  if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) == 0)
+    return;
+
+  pthread_mutex_lock(&prof_mtx);
+  for (size_t i = 0; i < PROF_TABLE_SIZE; i++) {
+    /* removal shifts next record of the chain here, so look again */
+    while (prof_table[i].ptr != NULL && match(prof_table[i].ptr, arg)) {
+      prof_remove(&prof_table[i]);
+      __atomic_sub_fetch(&prof_live, 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&prof_mtx);
+}
+
+/* Small buffered writer, so that we don't need stdio which allocates */
+typedef struct {
+  int fd;
+  size_t len;
+  char buf[4096];
+} prof_out_t;
+
+static void prof_flush(prof_out_t *out) {
+  size_t done = 0;
+
+  while (done < out->len) {
+    ssize_t n = write(out->fd, out->buf + done, out->len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+
+  out->len = 0;
+}
+
+__format(printf, 2, 3) static void prof_printf(prof_out_t *out, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  if (sizeof(out->buf) - out->len < 256)
+    prof_flush(out);
+
+  va_start(ap, fmt);
+  n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+  va_end(ap);
+
+  out->len += min((size_t)n, sizeof(out->buf) - out->len - 1);
+}
+
+/* Writes live samples in legacy pprof heap profile format */
+static int prof_dump_locked(const char *path) {
+  char name[256];
+  prof_out_t out = {.len = 0};
+  size_t bytes = 0;
+
+  if (prof_table == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (path == NULL) {
+    snprintf(name, sizeof(name), "%s.%d.%u.heap", prof_prefix, getpid(), prof_dump_seq++);
+    path = name;
+  }
+
+  if ((out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    debug("Failed to open '%s' for heap profile", path);
+    return -1;
+  }
+
+  for (size_t i = 0; i < PROF_TABLE_SIZE; i++)
+    if (prof_table[i].ptr)
+      bytes += prof_table[i].size;
+
+  prof_printf(&out, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%ld\n",
+              prof_live, bytes, prof_live, bytes, prof_rate);
+
+  for (size_t i = 0; i < PROF_TABLE_SIZE; i++) {
+    prof_record_t *record = &prof_table[i];
+    if (record->ptr == NULL)
+      continue;
+    prof_printf(&out, " 1: %lu [1: %lu] @", record->size, record->size);
+    for (int j = 0; j < record->depth; j++)
+      prof_printf(&out, " %p", record->frames[j]);
+    prof_printf(&out, "\n");
+  }
+
+  /* pprof needs memory map to symbolize addresses */
+  prof_printf(&out, "\nMAPPED_LIBRARIES:\n");
+  prof_flush(&out);
+
+  int maps;
+  if ((maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC)) >= 0) {
+    ssize_t n;
+    while ((n = read(maps, out.buf, sizeof(out.buf))) > 0) {
+      out.len = n;
+      prof_flush(&out);
+    }
+    close(maps);
+  }
+
+  close(out.fd);
+  return 0;
+}
+
+int malloc_prof_dump(const char *path) {
+  int res;
+
+  pthread_mutex_lock(&prof_mtx);
+  res = prof_dump_locked(path);
+  pthread_mutex_unlock(&prof_mtx);
+
+  return res;
+}
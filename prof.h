@@ -0,0 +1,35 @@
+#pragma once
+
+#include "malloc.h"
+
+/*
+ * Sampling heap profiler. On average one allocation per 'MALLOC_PROF_SAMPLE'
+ * bytes allocated gets its backtrace recorded in a side table, which can be
+ * dumped in pprof's heap profile format.
+ *
+ * Each thread counts down bytes left until next sample, so unsampled path
+ * is only a single subtraction. Countdown starts at zero, which makes first
+ * allocation of every thread take the slow path and draw proper interval,
+ * which that allocation already counts against (or effectively disable
+ * sampling if profiler is off).
+ */
+
+extern __thread int64_t prof_countdown __initial_exec;
+extern size_t prof_live;
+
+void prof_init(void);
+void prof_sample(void *ptr, size_t size);
+void prof_free(void *ptr);
+void prof_free_matching(bool (*match)(void *ptr, void *arg), void *arg);
+
+#define PROF_ALLOC(ptr, size)                                                  \
+  do {                                                                         \
+    if (__unlikely((prof_countdown -= (int64_t)(size)) < 0))                   \
+      prof_sample((ptr), (size));                                              \
+  } while (0)
+
+#define PROF_FREE(ptr)                                                         \
+  do {                                                                         \
+    if (__unlikely(__atomic_load_n(&prof_live, __ATOMIC_RELAXED)))             \
+      prof_free(ptr);                                                          \
+  } while (0)
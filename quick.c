@@ -0,0 +1,108 @@
+#include "malloc.h"
+#include "arena.h"
+#include "quick.h"
+#include "invariants.h"
+
+void quick_init(arena_t *arena) {
+  memset(arena->quick, 0, sizeof(arena->quick));
+  arena->nquick = 0;
+}
+
+/*
+ * Puts freed 'block' in quick bin. Returns false if it's too big for any
+ * or block before it is free, as merging with it costs next to nothing.
+ */
+bool quick_push(arena_t *arena, block_t *block) {
+  size_t size = BLOCK_SIZE(block);
+
+  assert_allocated_block(block);
+
+  if (size > QUICK_MAX_SIZE || (BLOCK_FLAGS(block) & BLOCK_PREV_FREE))
+    return false;
+
+  if (arena->nquick >= QUICK_LIMIT)
+    quick_flush(arena);
+
+  BLOCK_SET_HEADER(block, size, BLOCK_FLAGS(block) | BLOCK_QUICK, true);
+  block->qnext = arena->quick[QUICK_BIN(size)];
+  arena->quick[QUICK_BIN(size)] = block;
+  arena->nquick++;
+
+  return true;
+}
+
+/* Takes block that fits 'size' bytes exactly from quick bins of 'owner' */
+block_t *quick_pop(ma_list_t *arenas, uint32_t owner, size_t size,
+                   arena_t **arenap) {
+  size_t datasize = BLOCK_REQUIRED_DATA_SIZE(size);
+  arena_t *arena;
+  block_t *block;
+
+  if (datasize > QUICK_MAX_SIZE)
+    return NULL;
+
+  LIST_FOREACH(arena, arenas, link) {
+    if (arena->owner != owner)
+      continue;
+    if ((block = arena->quick[QUICK_BIN(datasize)])) {
+      arena->quick[QUICK_BIN(datasize)] = block->qnext;
+      arena->nquick--;
+      BLOCK_SET_HEADER(block, datasize, BLOCK_FLAGS(block) & ~BLOCK_QUICK, true);
+      *arenap = arena;
+      return block;
+    }
+  }
+
+  return NULL;
+}
+
+/* Removes 'block' from its quick bin & releases it to free index */
+void quick_take(arena_t *arena, block_t *block) {
+  block_t **linkp = &arena->quick[QUICK_BIN(BLOCK_SIZE(block))];
+
+  assert(BLOCK_FLAGS(block) & BLOCK_QUICK);
+
+  while (*linkp != block)
+    linkp = &(*linkp)->qnext;
+
+  *linkp = block->qnext;
+  arena->nquick--;
+
+  BLOCK_SET_HEADER(block, BLOCK_SIZE(block), BLOCK_FLAGS(block) & ~BLOCK_QUICK, true);
+  block_deallocate(arena, block);
+}
+
+/* Releases all blocks from quick bins of 'arena' to free index */
+void quick_flush(arena_t *arena) {
+  block_t *block;
+
+  for (int i = 0; i < QUICK_BINS; i++) {
+    while ((block = arena->quick[i])) {
+      arena->quick[i] = block->qnext;
+      arena->nquick--;
+      BLOCK_SET_HEADER(block, BLOCK_SIZE(block),
+                       BLOCK_FLAGS(block) & ~BLOCK_QUICK, true);
+      block_deallocate(arena, block);
+    }
+  }
+}
+
+/*
+ * Flushes quick bins of 'arenas' of 'owner' (or of all for ARENA_ANY_OWNER),
+ * returns false if they were empty.
+ */
+bool quick_flush_all(ma_list_t *arenas, uint32_t owner) {
+  arena_t *arena;
+  bool flushed = false;
+
+  LIST_FOREACH(arena, arenas, link) {
+    if (owner != ARENA_ANY_OWNER && arena->owner != owner)
+      continue;
+    if (arena->nquick) {
+      quick_flush(arena);
+      flushed = true;
+    }
+  }
+
+  return flushed;
+}
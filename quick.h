@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+/*
+ * Quick bins hold recently freed small blocks of the arena by exact data
+ * size. Such blocks stay marked allocated (with BLOCK_QUICK flag), so
+ * neighbours don't merge with them & free index doesn't know about them.
+ * That makes free of hot size a push and next malloc of that size a pop.
+ * Blocks are coalesced in batches: when arena holds too many of them or
+ * when there's no free block for an allocation.
+ */
+
+/* Largest data size kept in quick bins */
+#define QUICK_MAX_SIZE (QUICK_BINS * BLOCK_ALIGNMENT)
+
+/* How many blocks arena may hold in all quick bins before it flushes them */
+#define QUICK_LIMIT 32
+
+#define QUICK_BIN(datasize) ((datasize) / BLOCK_ALIGNMENT - 1)
+
+void quick_init(arena_t *arena);
+bool quick_push(arena_t *arena, block_t *block);
+block_t *quick_pop(ma_list_t *arenas, uint32_t owner, size_t size,
+                   arena_t **arenap);
+void quick_take(arena_t *arena, block_t *block);
+void quick_flush(arena_t *arena);
+bool quick_flush_all(ma_list_t *arenas, uint32_t owner);
@@ -0,0 +1,439 @@
+/*
+ * Replays allocation trace recorded by malloc.so with MALLOC_TRACE_FILE set.
+ *
+ * It isn't linked with malloc.so, so by default it runs against system
+ * allocator. To replay against another one, preload it:
+ *
+ *   LD_PRELOAD=./malloc.so ./replay trace.bin
+ *
+ * Every recorded thread gets its own replaying thread. Operations are
+ * executed one at a time in the order of their timestamps, so the original
+ * interleaving of threads is preserved exactly, including cross-thread frees.
+ * Replay's own bookkeeping is mmapped, so it doesn't disturb the allocator.
+ */
+
+#define _GNU_SOURCE
+#include "trace.h"
+#include "malloc_ext.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NONE ((uint32_t)-1)
+
+typedef struct op {
+  uint8_t kind;    /* trace_op_t */
+  uint32_t thread; /* index of replaying thread */
+  uint32_t slot;   /* index of allocation in 'slots' */
+  uint64_t size;
+  uint64_t align;
+} op_t;
+
+typedef struct thread {
+  pthread_t handle;
+  uint32_t tid;
+  uint32_t *ops; /* indices of operations executed by this thread */
+  size_t nops;
+} thread_t;
+
+static op_t *ops;
+static size_t nops;
+static void **slots;
+static uint64_t *sizes;
+static size_t nslots;
+static thread_t *threads;
+static size_t nthreads;
+static uint32_t *latency;
+static bool touch = true;
+
+/* index of operation which is allowed to execute now */
+static size_t turn = 0;
+
+static void *xmmap(size_t size) {
+  void *mem = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  return mem;
+}
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Stable bottom-up merge sort of events by timestamp, doesn't allocate */
+static void sort_events(trace_event_t *events, size_t n) {
+  trace_event_t *tmp = xmmap(n * sizeof(trace_event_t));
+  trace_event_t *src = events, *dst = tmp;
+
+  for (size_t width = 1; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = lo + width < n ? lo + width : n;
+      size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi)
+        dst[k++] = (src[j].timestamp < src[i].timestamp) ? src[j++] : src[i++];
+      while (i < mid)
+        dst[k++] = src[i++];
+      while (j < hi)
+        dst[k++] = src[j++];
+    }
+    trace_event_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != events)
+    memcpy(events, src, n * sizeof(trace_event_t));
+  munmap(tmp, n * sizeof(trace_event_t));
+}
+
+static void sort_u32(uint32_t *a, size_t n) {
+  /* LSD radix sort, two passes of 16 bits */
+  uint32_t *tmp = xmmap(n * sizeof(uint32_t));
+  for (int shift = 0; shift < 32; shift += 16) {
+    static size_t count[65537];
+    memset(count, 0, sizeof(count));
+    for (size_t i = 0; i < n; i++)
+      count[((a[i] >> shift) & 0xffff) + 1]++;
+    for (size_t i = 1; i < 65537; i++)
+      count[i] += count[i - 1];
+    for (size_t i = 0; i < n; i++)
+      tmp[count[(a[i] >> shift) & 0xffff]++] = a[i];
+    memcpy(a, tmp, n * sizeof(uint32_t));
+  }
+  munmap(tmp, n * sizeof(uint32_t));
+}
+
+/* Open addressing map from traced pointer to slot */
+typedef struct {
+  uint64_t ptr;
+  uint32_t slot;
+} entry_t;
+
+static entry_t *map;
+static size_t mapmask;
+
+static entry_t *map_find(uint64_t ptr) {
+  size_t i = ((ptr >> 4) * 0x9e3779b97f4a7c15ULL) & mapmask;
+  while (map[i].ptr && map[i].ptr != ptr)
+    i = (i + 1) & mapmask;
+  return &map[i];
+}
+
+static void map_remove(entry_t *e) {
+  size_t i = e - map, j = i;
+  for (;;) {
+    j = (j + 1) & mapmask;
+    if (map[j].ptr == 0)
+      break;
+    size_t k = ((map[j].ptr >> 4) * 0x9e3779b97f4a7c15ULL) & mapmask;
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    map[i] = map[j];
+    i = j;
+  }
+  map[i].ptr = 0;
+}
+
+static uint32_t thread_index(uint32_t tid) {
+  for (size_t i = 0; i < nthreads; i++)
+    if (threads[i].tid == tid)
+      return i;
+  threads[nthreads].tid = tid;
+  return nthreads++;
+}
+
+/*
+ * Turns events into operations on slots. Trace may contain pointers we
+ * know nothing about, e.g. freed memory allocated before tracing started.
+ * Such operations are dropped.
+ */
+static void prepare(trace_event_t *events, size_t n) {
+  size_t mapsize = 1;
+  while (mapsize < 2 * n)
+    mapsize *= 2;
+  map = xmmap(mapsize * sizeof(entry_t));
+  mapmask = mapsize - 1;
+
+  ops = xmmap(n * sizeof(op_t));
+  threads = xmmap(n * sizeof(thread_t));
+
+  for (size_t i = 0; i < n; i++) {
+    trace_event_t *ev = &events[i];
+    op_t op = {.kind = ev->op, .size = ev->size, .slot = NONE};
+    entry_t *e;
+
+    switch (ev->op) {
+      case TRACE_MALLOC:
+      case TRACE_MEMALIGN:
+        if (ev->ptr == 0)
+          continue;
+        op.align = ev->arg;
+        op.slot = nslots++;
+        *(e = map_find(ev->ptr)) = (entry_t){ev->ptr, op.slot};
+        break;
+
+      case TRACE_FREE:
+        if ((e = map_find(ev->ptr))->ptr == 0)
+          continue;
+        op.slot = e->slot;
+        map_remove(e);
+        break;
+
+      case TRACE_REALLOC:
+        if (ev->arg == 0) {
+          /* realloc(NULL, size) */
+          if (ev->ptr == 0)
+            continue;
+          op.kind = TRACE_MALLOC;
+          op.slot = nslots++;
+        }
+        else {
+          if ((e = map_find(ev->arg))->ptr == 0)
+            continue;
+          /* failed realloc leaves memory as it was */
+          if (ev->ptr == 0 && ev->size != 0)
+            continue;
+          op.slot = e->slot;
+          map_remove(e);
+        }
+        if (ev->ptr)
+          *(e = map_find(ev->ptr)) = (entry_t){ev->ptr, op.slot};
+        break;
+
+      default:
+        fprintf(stderr, "Unknown event %d, trace is corrupted.\n", ev->op);
+        exit(EXIT_FAILURE);
+    }
+
+    op.thread = thread_index(ev->tid);
+    threads[op.thread].nops++;
+    ops[nops++] = op;
+  }
+
+  for (size_t t = 0; t < nthreads; t++) {
+    threads[t].ops = xmmap(threads[t].nops * sizeof(uint32_t));
+    threads[t].nops = 0;
+  }
+
+  for (size_t i = 0; i < nops; i++) {
+    thread_t *t = &threads[ops[i].thread];
+    t->ops[t->nops++] = i;
+  }
+
+  munmap(map, mapsize * sizeof(entry_t));
+
+  slots = xmmap(nslots * sizeof(void *));
+  sizes = xmmap(nslots * sizeof(uint64_t));
+  latency = xmmap(nops * sizeof(uint32_t));
+
+  /* fault our pages in now, so they don't count as allocator's memory */
+  memset(slots, 0, nslots * sizeof(void *));
+  memset(sizes, 0, nslots * sizeof(uint64_t));
+  memset(latency, 0, nops * sizeof(uint32_t));
+}
+
+static void touch_pages(void *ptr, size_t size) {
+  size_t pagesize = 4096;
+  for (size_t i = 0; i < size; i += pagesize)
+    ((volatile char *)ptr)[i] = 1;
+}
+
+static void execute(op_t *op) {
+  void **slot = &slots[op->slot];
+
+  switch (op->kind) {
+    case TRACE_MALLOC:
+      *slot = malloc(op->size);
+      break;
+    case TRACE_MEMALIGN:
+      *slot = memalign(op->align, op->size);
+      break;
+    case TRACE_FREE:
+      free(*slot);
+      *slot = NULL;
+      break;
+    case TRACE_REALLOC:
+      *slot = realloc(*slot, op->size);
+      break;
+  }
+}
+
+static void *replay_thread(void *arg) {
+  thread_t *self = arg;
+
+  for (size_t i = 0; i < self->nops; i++) {
+    size_t index = self->ops[i];
+    op_t *op = &ops[index];
+
+    for (int spin = 0; __atomic_load_n(&turn, __ATOMIC_ACQUIRE) != index; spin++)
+      if (spin > 100)
+        sched_yield();
+
+    uint64_t start = now();
+    execute(op);
+    uint64_t elapsed = now() - start;
+    latency[index] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+
+    if (op->kind != TRACE_FREE) {
+      sizes[op->slot] = slots[op->slot] ? op->size : 0;
+      if (touch && slots[op->slot])
+        touch_pages(slots[op->slot], op->size);
+    }
+    else {
+      sizes[op->slot] = 0;
+    }
+
+    __atomic_store_n(&turn, index + 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+static size_t rss_bytes(void) {
+  long pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+      rss = 0;
+    fclose(f);
+  }
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+/* Resets peak RSS, so it covers only the replay itself */
+static void reset_peak_rss(void) {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd >= 0) {
+    if (write(fd, "5", 1) < 0)
+      perror("clear_refs");
+    close(fd);
+  }
+}
+
+static void report_latency(const char *name, int kind) {
+  size_t n = 0;
+  for (size_t i = 0; i < nops; i++)
+    n += ops[i].kind == kind;
+  if (n == 0)
+    return;
+
+  uint32_t *lat = xmmap(n * sizeof(uint32_t));
+  for (size_t i = 0, j = 0; i < nops; i++)
+    if (ops[i].kind == kind)
+      lat[j++] = latency[i];
+  sort_u32(lat, n);
+
+  printf("%-9s %10zu ops  p50 %6u  p90 %6u  p99 %7u  p99.9 %8u  max %9u ns\n",
+         name, n, lat[n / 2], lat[n * 90 / 100], lat[n * 99 / 100],
+         lat[n * 999 / 1000], lat[n - 1]);
+
+  munmap(lat, n * sizeof(uint32_t));
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-n] trace\n", prog);
+  fprintf(stderr, "  -n  don't touch allocated memory\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n")) != -1) {
+    if (opt == 'n')
+      touch = false;
+    else
+      usage(argv[0]);
+  }
+
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  int fd;
+  struct stat st;
+  if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  trace_header_t *header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE, fd, 0);
+  if (header == MAP_FAILED || (size_t)st.st_size < sizeof(trace_header_t)
+      || header->magic != TRACE_MAGIC || header->record_size != TRACE_RECORD_SIZE) {
+    fprintf(stderr, "%s: not a malloc trace\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  trace_event_t *events = (trace_event_t *)(header + 1);
+  size_t nevents = st.st_size / TRACE_RECORD_SIZE - 1;
+
+  sort_events(events, nevents);
+  prepare(events, nevents);
+  munmap(header, st.st_size);
+  close(fd);
+
+  const char *allocator = getenv("LD_PRELOAD");
+  printf("allocator: %s\n", allocator ? allocator : "system");
+  printf("events: %zu, replayed ops: %zu, threads: %zu\n", nevents, nops, nthreads);
+
+  reset_peak_rss();
+  size_t rss_before = rss_bytes();
+  uint64_t start = now();
+
+  for (size_t t = 0; t < nthreads; t++)
+    pthread_create(&threads[t].handle, NULL, replay_thread, &threads[t]);
+  for (size_t t = 0; t < nthreads; t++)
+    pthread_join(threads[t].handle, NULL);
+
+  uint64_t elapsed = now() - start;
+
+  printf("time: %.3f s, throughput: %.0f ops/s\n", elapsed / 1e9,
+         nops / (elapsed / 1e9));
+
+  report_latency("malloc", TRACE_MALLOC);
+  report_latency("free", TRACE_FREE);
+  report_latency("realloc", TRACE_REALLOC);
+  report_latency("memalign", TRACE_MEMALIGN);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("peak RSS: %ld KiB, at start: %zu KiB\n", ru.ru_maxrss,
+         rss_before / 1024);
+
+  /* memory still allocated at the end vs. memory allocator holds for it */
+  size_t live = 0;
+  for (size_t i = 0; i < nslots; i++)
+    live += sizes[i];
+  size_t rss = rss_bytes() - rss_before;
+  printf("live: %zu bytes, RSS growth: %zu bytes, fragmentation: %.3f\n", live,
+         rss, rss > live ? 1.0 - (double)live / rss : 0.0);
+
+  /* malloc.so knows better, ask it if it's there */
+  typeof(malloc_heap_report) *heap_report = dlsym(RTLD_DEFAULT, "malloc_heap_report");
+  if (heap_report) {
+    struct malloc_heap_report r;
+    heap_report(&r);
+    printf("heap: %zu bytes mapped, %zu free in %zu blocks, fragmentation %.3f\n",
+           r.mapped_bytes, r.free_bytes, r.free_blocks, r.fragmentation);
+  }
+
+  return EXIT_SUCCESS;
+}
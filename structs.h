@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/queue.h>
 
@@ -8,83 +9,167 @@
  *
  * Small arena consists of blocks placed contigously one after another,
  * starting at first valid address just after arena header. It also
- * maintains explicit list of available free blocks.
+ * maintains explicit index of available free blocks.
  *
  * Big arena consists of one chunk of memory starting at 'arena.data'.
  * There is no notion of blocks here.
  *
+ * Page arena hands out runs of whole pages following its header page,
+ * which also holds map of runs, see arena.h.
+ *
+ * Aligned arena is cut into slots of one size class, each of them aligned
+ * to the lowest set bit of class size. Free slots form a list threaded
+ * through them, slots past 'fresh' were never handed out.
+ *
  * Size in both cases means total bytes allocated including arena header.
  * Each arena is allocated at granularity of memory page.
  */
 
-typedef enum { SMALL, BIG } ma_kind_t;
+typedef enum { SMALL, BIG, PAGE, ALIGNED } ma_kind_t;
 
-typedef LIST_ENTRY(block) mb_node_t;
-typedef LIST_HEAD(, block) mb_list_t;
 typedef LIST_ENTRY(arena) ma_node_t;
 typedef LIST_HEAD(, arena) ma_list_t;
 
+/*
+ * Index of free blocks in small arena, see freeidx.h. By default it's
+ * red-black tree threaded through free blocks, nodes refer to each other
+ * by offsets from arena start, 0 being none. With FREE_ARRAY it's kept
+ * aside as dense arrays of offsets & data sizes of free blocks, sorted
+ * by offset.
+ */
+#ifdef FREE_ARRAY
+typedef struct {
+  uint32_t *offset;
+  uint32_t *size;
+  uint32_t count;
+  uint32_t capacity;
+} mb_index_t;
+#else
+typedef struct {
+  uint32_t root;
+} mb_index_t;
+#endif
+
+/* Tree node kept in data of free block, it must fit in minimal block */
+typedef struct {
+  uint32_t left;
+  uint32_t right;
+  uint32_t parent;
+  uint32_t max; /* largest data size in subtree, lowest bit is color */
+} mb_node_t;
+
+/* Number of quick bins, one per data size: 16, 32, ... see quick.h */
+#define QUICK_BINS 8
+
+/*
+ * Small & aligned arenas are owned by thread that mapped them, only owner
+ * carves new blocks out of them, so objects of different threads don't
+ * share cache lines. Other threads just free to them, see arena.c.
+ * When owner exits, its arenas are orphaned & adopted by next thread
+ * that needs memory. ARENA_ANY_OWNER matches every arena in lookups.
+ * Arenas of shared sets (private heaps) are never owned by any thread.
+ */
+#define ARENA_NO_OWNER 0
+#define ARENA_ANY_OWNER UINT32_MAX
+
 typedef struct arena {
   ma_kind_t kind;
+  uint32_t owner;
+  uint32_t dirtied; /* purge epoch of last free, 0 if clean, see arena.h */
+  uint32_t node; /* NUMA node memory is bound to, see arena.h */
   ma_node_t link;
   int64_t size;
 
   union {
-    /* for small arenas we only need list of free blocks */
-    mb_list_t freeblks;
+    /* for small arenas we need index of free blocks & quick bins */
+    struct {
+      mb_index_t freeblks;
+      struct block *quick[QUICK_BINS];
+      uint32_t nquick;
+    };
 
     /* for big arena we store pointer to data & its size */
     struct {
       uint64_t *data;
       uint64_t datasize;
     };
+
+    /* for page arena we count pages, the map follows header */
+    struct {
+      uint32_t npages;
+      uint32_t usedpages;
+    };
+
+    /* for aligned arena we keep size class & free slots */
+    struct {
+      uint32_t slotclass;
+      uint32_t nslots;
+      uint32_t usedslots;
+      uint32_t fresh;
+      void *freeslots;
+    };
   };
 } arena_t;
 
 typedef struct {
   ma_list_t *small;
   ma_list_t *big;
+  ma_list_t *page;
+  ma_list_t *aligned; /* array with list for every size class */
+  ma_list_t *cached;  /* big mappings kept for reuse, NULL if none */
+  bool shared;        /* used under one lock by all threads, never owned */
 } arenas_t;
 
 
 /*
- * Blocks are represented as payload with tags at both ends.
- * For simplicity, tags are 8 bytes long. Negative tag value
- * indicates allocated block whereas positive free block.
+ * Every block starts with 8 byte tag (header) holding size of its
+ * data. Negative value indicates allocated block whereas positive
+ * free block. Size of data is multiple of 16, so lowest bits of the
+ * tag hold flags: BLOCK_PREV_FREE, BLOCK_QUICK & BLOCK_ZERO.
  *
  * Blocks are placed continously one after another such that
- * their data pointers are always aligned at 16. For this
- * reason, size of data inside block is also multple of 16.
- * This invariant is assumed across implementation files.
+ * their data pointers are always aligned at 16. This invariant
+ * is assumed across implementation files.
+ *
+ * Only free blocks have trailing tag (footer) repeating the size.
+ * Allocated block lends its place to the payload, so usable size
+ * is data size + 8. That's why we can reach previous block only
+ * when it's free, which block header tells by BLOCK_PREV_FREE.
+ * Free block keeps its node of free index at start of its data.
  *
- * Tags are placed on addresses such that data following tag
- * is always properly aligned.
+ *        _________ allocated block _________
+ *       /                                   \
+ *    ---+-----+-----------------------------+-----+---
+ *       | hdr |           payload           | hdr |
+ *    ---+-----+-----------------------------+-----+---
+ *       |     |                             |     |
+ *       8    16                             8    16
  *
- *              ____________ block ____________
- *             /                               \
- *    ---+-----+-----+-------------------+-----+-----+---
- *       | tag | tag |      payload      | tag | tag |
- *    ---+-----+-----+-------------------+-----+-----+---
- *       |     |     |                   |     |     |
- *      16     8    16                  16     8    16
+ *        ___________ free block ____________
+ *       /                                   \
+ *    ---+-----+------+---------------+------+-----+---
+ *       | hdr | node |               | ftr  | hdr |
+ *    ---+-----+------+---------------+------+-----+---
+ *       |     |                      |      |     |
+ *       8    16                     16      8    16
  *
  *
- * To allow safe block traversal by tags, we need extra fake
- * tags at boundary blocks inside arena. First block is always
- * preceeded with fake NUL tag, same for last block which is
- * always followed by fake NUL tag.
+ * To allow safe block traversal, we need extra fake tags at
+ * boundary blocks inside arena. First block is always preceeded
+ * with fake NUL tag, same for last block which is always followed
+ * by fake NUL tag.
  *
  *           _________ first block _________
  *          /                               \
- *    +-----+-----+-------------------+-----+-----+---
- *    | NUL | tag |      payload      | tag | tag |
- *    +-----+-----+-------------------+-----+-----+---
+ *    +-----+-----+-------------------------+-----+---
+ *    | NUL | hdr |         payload         | hdr |
+ *    +-----+-----+-------------------------+-----+---
  *
- *              _________ last block __________
- *             /                               \
- *    ---+-----+-----+-------------------+-----+-----+
- *       | tag | tag |      payload      | tag | NUL |
- *    ---+-----+-----+-------------------+-----+-----+
+ *        _________ last block __________
+ *       /                               \
+ *    ---+-----+-------------------------+-----+
+ *       | hdr |         payload         | NUL |
+ *    ---+-----+-------------------------+-----+
  */
 
 typedef int64_t mb_tag_t;
@@ -92,7 +177,8 @@ typedef int64_t mb_tag_t;
 typedef struct block {
   mb_tag_t size;
   union {
-    mb_node_t link;
+    mb_node_t node;
+    struct block *qnext; /* next block in quick bin */
     uint64_t data[0];
   };
 } block_t;
@@ -1,10 +1,13 @@
 #include "test.h"
+#include "malloc_ext.h"
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define RED "\033[91m"
@@ -20,17 +23,120 @@ static int run_test(test_t *tst) {
   fprintf(stderr, "Test '%s'... %s\n" RST, tst->name,
           wstatus ? RED "failed" : GRN "passed");
   if (WIFSIGNALED(wstatus))
-    fprintf(stderr, "Killed by '%s' signal!\n", sys_siglist[WTERMSIG(wstatus)]);
+    fprintf(stderr, "Killed by '%s' signal!\n", strsignal(WTERMSIG(wstatus)));
   return wstatus;
 }
 
+BENCHES_DECLARE();
+
+/* Benchmark is run BENCH_RUNS times, each run taking at least BENCH_MIN_NS */
+#define BENCH_RUNS 11
+#define BENCH_MIN_NS (10 * 1000 * 1000)
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t time_bench(bench_t *bench, size_t iterations) {
+  uint64_t start = now();
+  bench->func(iterations);
+  return now() - start;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void do_bench(bench_t *bench) {
+  double ns[BENCH_RUNS];
+  size_t iterations = 1;
+  struct rusage before, after;
+  struct malloc_heap_report report;
+
+  /* warm up & find number of iterations that takes long enough to measure */
+  while (time_bench(bench, iterations) < BENCH_MIN_NS)
+    iterations *= 2;
+
+  getrusage(RUSAGE_SELF, &before);
+  for (int i = 0; i < BENCH_RUNS; i++)
+    ns[i] = (double)time_bench(bench, iterations) / iterations;
+  getrusage(RUSAGE_SELF, &after);
+
+  qsort(ns, BENCH_RUNS, sizeof(double), cmp_double);
+  malloc_heap_report(&report);
+
+  fprintf(stderr,
+          "Bench '%s'... %d x %zu ops, median %.1f ns/op, min %.1f ns/op\n"
+          "  %ld minor faults, %ld major faults, %zu bytes mapped in %zu "
+          "small & %zu big arenas, fragmentation %.3f\n",
+          bench->name, BENCH_RUNS, iterations, ns[BENCH_RUNS / 2], ns[0],
+          after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt,
+          report.mapped_bytes, report.small_arenas, report.big_arenas,
+          report.fragmentation);
+}
+
+/* Every benchmark runs in its own process, so they don't share the heap */
+static int run_bench(bench_t *bench) {
+  if (fork() == 0) {
+    do_bench(bench);
+    exit(EXIT_SUCCESS);
+  }
+  int wstatus;
+  wait(&wstatus);
+  if (WIFSIGNALED(wstatus))
+    fprintf(stderr, "Bench '%s'... " RED "killed by '%s' signal!\n" RST,
+            bench->name, strsignal(WTERMSIG(wstatus)));
+  return wstatus;
+}
+
+static int run_benches(int argc, char *argv[]) {
+  int status = EXIT_SUCCESS;
+
+  if (argc == 0) {
+    BENCHES_FOREACH (bench_p) { status |= run_bench(*bench_p); }
+    return status;
+  }
+
+  for (int i = 0; i < argc; i++) {
+    bool found = false;
+
+    BENCHES_FOREACH (bench_p) {
+      if (strcmp(argv[i], (*bench_p)->name) == 0) {
+        found = true;
+        status |= run_bench(*bench_p);
+      }
+    }
+
+    if (!found) {
+      fprintf(stderr, "Bench '%s'... " YLW "not found\n" RST, argv[i]);
+      status = EXIT_FAILURE;
+    }
+  }
+
+  return status;
+}
+
 TESTS_DECLARE();
 
 int main(int argc, char *argv[]) {
   int status = EXIT_SUCCESS;
+  bool quiet = false;
 
   setlinebuf(stderr);
 
+  /* ./test -b [bench...] runs benchmarks instead of tests */
+  if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    return run_benches(argc - 2, argv + 2);
+
+  /* ./test -q test... runs tests silently, for tests that rerun themselves */
+  if (argc > 2 && strcmp(argv[1], "-q") == 0) {
+    quiet = true;
+    argc--, argv++;
+  }
+
   if (argc == 1) {
     TESTS_FOREACH (tst_p) { status |= run_test(*tst_p); }
   } else {
@@ -44,8 +150,9 @@ int main(int argc, char *argv[]) {
         if (strcmp(argv[i], tst->name) == 0) {
           found = true;
           status = tst->func() ? EXIT_FAILURE : EXIT_SUCCESS;
-          fprintf(stderr, "Test '%s'... %s" RST "\n", tst->name,
-                  status ? RED "failed" : GRN "passed");
+          if (!quiet)
+            fprintf(stderr, "Test '%s'... %s" RST "\n", tst->name,
+                    status ? RED "failed" : GRN "passed");
         }
       }
 
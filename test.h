@@ -1,6 +1,7 @@
 #pragma once
 
 #include <assert.h>
+#include <stddef.h>
 
 #define __section(x) __attribute__((section(x)))
 #define __used __attribute__((used))
@@ -27,3 +28,31 @@ typedef struct test {
 
 #define TESTS_FOREACH(tst_p)                                                   \
   for (test_t **tst_p = TESTS_BEGIN(); tst_p < TESTS_END(); tst_p++)
+
+/*
+ * Micro-benchmarks. Body has to do 'iterations' operations, runner picks
+ * the count, times repeated runs and reports ns per operation.
+ */
+typedef struct bench {
+  const char *name;
+  void (*func)(size_t iterations);
+} bench_t;
+
+#define BENCH(name)                                                            \
+  static void bench_##name(size_t iterations);                                 \
+  __asm__(".globl __start_set_benches");                                       \
+  __asm__(".globl __stop_set_benches");                                        \
+  static bench_t *__set_benches_##name __section("set_benches") __used =       \
+    &(bench_t){#name, bench_##name};                                           \
+  static void bench_##name(size_t iterations)
+
+/* weak, so that there's no need for any benchmark to be defined */
+#define BENCHES_DECLARE()                                                      \
+  extern bench_t *__start_set_benches __attribute__((weak));                   \
+  extern bench_t *__stop_set_benches __attribute__((weak))
+
+#define BENCHES_BEGIN() (&__start_set_benches)
+#define BENCHES_END() (&__stop_set_benches)
+
+#define BENCHES_FOREACH(bench_p)                                               \
+  for (bench_t **bench_p = BENCHES_BEGIN(); bench_p < BENCHES_END(); bench_p++)
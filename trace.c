@@ -0,0 +1,241 @@
+#include "malloc.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/*
+ * Every thread appends events to its own ring buffer, which is drained
+ * by background thread into memory mapped trace file. Producer only moves
+ * 'head' and consumer only moves 'tail', so there's no locking on the
+ * recording path. If the ring is full, producer waits for the flusher
+ * rather than dropping events, since a trace with holes cannot be replayed.
+ */
+
+/* Number of events in per thread ring, must be power of two */
+#define TRACE_RING_SIZE (1 << 16)
+
+/* File is mapped in windows, which are multiple of both page & record size */
+#define TRACE_WINDOW_SIZE (TRACE_RECORD_SIZE * 4096 * 100)
+
+/* How often background thread drains ring buffers */
+#define TRACE_FLUSH_NS (1000 * 1000)
+
+typedef struct trace_ring {
+  struct trace_ring *next;
+  uint64_t head;
+  uint64_t tail;
+  bool exited;
+  trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+bool trace_enabled = false;
+
+static __thread trace_ring_t *trace_self __initial_exec = NULL;
+static __thread uint32_t trace_tid __initial_exec = 0;
+
+/* Rings of all threads. Threads push to it, only flusher removes. */
+static trace_ring_t *trace_rings = NULL;
+
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_t trace_thread;
+
+static int trace_fd = -1;
+static uint64_t trace_pos = 0;    /* file offset of next event */
+static uint8_t *trace_window = NULL;
+static uint64_t trace_window_pos; /* file offset of mapped window */
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Makes sure record at 'trace_pos' is in mapped window, called with lock */
+static bool trace_window_map(void) {
+  if (trace_window && trace_pos < trace_window_pos + TRACE_WINDOW_SIZE)
+    return true;
+
+  if (trace_window)
+    munmap(trace_window, TRACE_WINDOW_SIZE);
+
+  trace_window_pos = trace_pos - trace_pos % TRACE_WINDOW_SIZE;
+  trace_window = NULL;
+
+  if (ftruncate(trace_fd, trace_window_pos + TRACE_WINDOW_SIZE) < 0) {
+    debug("ftruncate failed with \"%s\"", strerror(errno));
+    return false;
+  }
+
+  int prot = PROT_READ | PROT_WRITE;
+  void *window = mmap(NULL, TRACE_WINDOW_SIZE, prot, MAP_SHARED, trace_fd,
+                      trace_window_pos);
+  if (window == MAP_FAILED) {
+    debug("mmap failed with \"%s\"", strerror(errno));
+    return false;
+  }
+
+  trace_window = window;
+  return true;
+}
+
+static void trace_write(const void *record) {
+  if (!trace_window_map())
+    return;
+
+  memcpy(trace_window + (trace_pos - trace_window_pos), record, TRACE_RECORD_SIZE);
+  trace_pos += TRACE_RECORD_SIZE;
+}
+
+/* Moves events from all rings to the file, frees rings of exited threads */
+static void trace_flush(void) {
+  trace_ring_t **prevp = &trace_rings;
+  trace_ring_t *ring;
+
+  pthread_mutex_lock(&trace_mtx);
+
+  while ((ring = __atomic_load_n(prevp, __ATOMIC_ACQUIRE))) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    bool exited = __atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE);
+
+    for (uint64_t i = ring->tail; i < head; i++)
+      trace_write(&ring->events[i & (TRACE_RING_SIZE - 1)]);
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+    if (!exited || head != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+      prevp = &ring->next;
+      continue;
+    }
+
+    /* threads push new rings only at the front of the list */
+    if (prevp == &trace_rings) {
+      trace_ring_t *expected = ring;
+      if (!__atomic_compare_exchange_n(&trace_rings, &expected, ring->next, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        continue;
+    }
+    else {
+      *prevp = ring->next;
+    }
+
+    munmap(ring, sizeof(trace_ring_t));
+  }
+
+  pthread_mutex_unlock(&trace_mtx);
+}
+
+static void *trace_flusher(__unused void *arg) {
+  struct timespec delay = {.tv_sec = 0, .tv_nsec = TRACE_FLUSH_NS};
+
+  for (;;) {
+    nanosleep(&delay, NULL);
+    trace_flush();
+  }
+
+  return NULL;
+}
+
+static void trace_thread_exit(void *ring) {
+  trace_self = NULL;
+  __atomic_store_n(&((trace_ring_t *)ring)->exited, true, __ATOMIC_RELEASE);
+}
+
+static trace_ring_t *trace_ring_create(void) {
+  trace_ring_t *ring;
+
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if ((ring = mmap(NULL, sizeof(trace_ring_t), prot, flags, -1, 0)) == MAP_FAILED)
+    return NULL;
+
+  ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  trace_self = ring;
+  trace_tid = syscall(SYS_gettid);
+
+  /* pthread_setspecific may allocate, so trace_self must be set already */
+  pthread_setspecific(trace_key, ring);
+
+  return ring;
+}
+
+void trace_record(trace_op_t op, void *ptr, size_t size, uintptr_t arg,
+                  uint64_t timestamp) {
+  trace_ring_t *ring = trace_self;
+
+  if (ring == NULL && (ring = trace_ring_create()) == NULL)
+    return;
+
+  uint64_t head = ring->head;
+
+  while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE)
+    sched_yield();
+
+  trace_event_t *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+  event->op = op;
+  event->tid = trace_tid;
+  event->timestamp = timestamp ? timestamp : trace_now();
+  event->ptr = (uintptr_t)ptr;
+  event->size = size;
+  event->arg = arg;
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Child doesn't have flusher thread and must not write to parent's file */
+static void trace_atfork_child(void) {
+  trace_enabled = false;
+}
+
+__attribute__((destructor)) static void trace_fini(void) {
+  if (!trace_enabled)
+    return;
+
+  trace_flush();
+
+  pthread_mutex_lock(&trace_mtx);
+  if (trace_window)
+    munmap(trace_window, TRACE_WINDOW_SIZE);
+  trace_window = NULL;
+  if (ftruncate(trace_fd, trace_pos) < 0)
+    debug("ftruncate failed with \"%s\"", strerror(errno));
+  pthread_mutex_unlock(&trace_mtx);
+}
+
+void trace_init(void) {
+  const char *path;
+
+  if ((path = getenv("MALLOC_TRACE_FILE")) == NULL)
+    return;
+
+  int flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+  if ((trace_fd = open(path, flags, 0644)) < 0) {
+    debug("Failed to open trace file '%s'", path);
+    return;
+  }
+
+  trace_header_t header = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .record_size = TRACE_RECORD_SIZE,
+  };
+  trace_write(&header);
+
+  pthread_key_create(&trace_key, trace_thread_exit);
+  pthread_atfork(NULL, NULL, trace_atfork_child);
+
+  if (pthread_create(&trace_thread, NULL, trace_flusher, NULL)) {
+    debug("Failed to start trace flusher thread");
+    return;
+  }
+
+  trace_enabled = true;
+}
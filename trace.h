@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary allocation trace. File starts with a header followed by events,
+ * both TRACE_RECORD_SIZE bytes long. Events come in chunks per thread, so
+ * they have to be sorted by timestamp to get the original interleaving.
+ *
+ * This header is shared by malloc.so, which records traces, and replay.
+ */
+
+#define TRACE_MAGIC 0x31304543415254ULL /* "TRACE01" */
+#define TRACE_VERSION 1
+#define TRACE_RECORD_SIZE 40
+
+typedef enum {
+  TRACE_MALLOC = 1, /* ptr = malloc(size) */
+  TRACE_FREE,       /* free(ptr) */
+  TRACE_REALLOC,    /* ptr = realloc(arg, size) */
+  TRACE_MEMALIGN,   /* ptr = memalign(arg, size) */
+} trace_op_t;
+
+typedef struct trace_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint8_t reserved[TRACE_RECORD_SIZE - 16];
+} trace_header_t;
+
+typedef struct trace_event {
+  uint8_t op;
+  uint8_t reserved[3];
+  uint32_t tid;
+  uint64_t timestamp; /* nanoseconds, CLOCK_MONOTONIC */
+  uint64_t ptr;
+  uint64_t size;
+  uint64_t arg;
+} trace_event_t;
+
+_Static_assert(sizeof(trace_header_t) == TRACE_RECORD_SIZE, "trace header size");
+_Static_assert(sizeof(trace_event_t) == TRACE_RECORD_SIZE, "trace event size");
+
+/* Recording, used only inside malloc.so */
+
+extern bool trace_enabled;
+
+void trace_init(void);
+uint64_t trace_now(void);
+void trace_record(trace_op_t op, void *ptr, size_t size, uintptr_t arg,
+                  uint64_t timestamp);
+
+#define TRACE(op, ptr, size, arg) TRACE_AT(0, op, ptr, size, arg)
+
+/*
+ * Records event with timestamp taken earlier by TRACE_STAMP, zero means now.
+ * Event that releases memory must be stamped before anyone can reuse it.
+ */
+#define TRACE_AT(timestamp, op, ptr, size, arg)                                \
+  do {                                                                         \
+    if (__unlikely(trace_enabled))                                             \
+      trace_record((op), (ptr), (size), (uintptr_t)(arg), (timestamp));        \
+  } while (0)
+
+#define TRACE_STAMP(timestamp)                                                 \
+  do {                                                                         \
+    if (__unlikely(trace_enabled))                                             \
+      (timestamp) = trace_now();                                               \
+  } while (0)
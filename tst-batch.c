@@ -0,0 +1,94 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 10000
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+static void *ptrs[N];
+
+TEST(malloc_batch) {
+  size_t n = malloc_batch(40, N, ptrs);
+
+  if (n != N)
+    merror("malloc_batch (40, N) allocated less than requested.");
+
+  for (size_t i = 0; i < n; i++) {
+    if ((uintptr_t)ptrs[i] % 16)
+      merror("malloc_batch returned misaligned pointer.");
+    if (malloc_usable_size(ptrs[i]) < 40)
+      merror("malloc_batch returned too small block.");
+    memset(ptrs[i], 0xff, 40);
+  }
+
+  for (size_t i = 0; i < n; i++)
+    free(ptrs[i]);
+
+  n = malloc_batch(1024 * 1024, 4, ptrs);
+  if (n != 4)
+    merror("malloc_batch (1M, 4) failed.");
+
+  free_batch(ptrs, n);
+
+  errno = 0;
+  n = malloc_batch(-1, 4, ptrs);
+  if (n != 0 || errno != ENOMEM)
+    merror("malloc_batch (-1, 4) succeeded.");
+
+  return errors != 0;
+}
+
+TEST(free_batch) {
+  size_t n = malloc_batch(100, N, ptrs);
+
+  if (n != N)
+    merror("malloc_batch (100, N) allocated less than requested.");
+
+  /* shuffle, so free_batch has to put them back in order */
+  for (size_t i = 0; i < n; i++) {
+    size_t j = random() % n;
+    void *tmp = ptrs[i];
+    ptrs[i] = ptrs[j];
+    ptrs[j] = tmp;
+  }
+
+  ptrs[n / 2] = NULL;
+  free_batch(ptrs, n);
+
+  /* everything got coalesced, so one big block should be available */
+  void *p = malloc(200 * 1024);
+  if (p == NULL)
+    merror("malloc (200K) after free_batch failed.");
+  free(p);
+
+  return errors != 0;
+}
+
+/* one operation is allocation & release of a single block */
+BENCH(malloc_batch_40) {
+  for (size_t i = 0; i < iterations; i += 64) {
+    size_t n = malloc_batch(40, 64, ptrs);
+    free_batch(ptrs, n);
+  }
+}
+
+/* the same as malloc_batch_40 done one by one, for comparison */
+BENCH(malloc_loop_40) {
+  for (size_t i = 0; i < iterations; i += 64) {
+    for (size_t j = 0; j < 64; j++)
+      ptrs[j] = malloc(40);
+    for (size_t j = 0; j < 64; j++)
+      free(ptrs[j]);
+  }
+}
@@ -23,6 +23,7 @@
 #include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Number of samples per size.  */
 #define N 50000
@@ -105,3 +106,47 @@ TEST(calloc_fixed) {
 
   return 0;
 }
+
+TEST(calloc_overflow) {
+  /* volatile, so that compiler doesn't see through the overflow */
+  volatile size_t half = ~((size_t)0) / 2 + 1;
+
+  errno = 0;
+  if (calloc(half, 2) != NULL || errno != ENOMEM)
+    error(EXIT_FAILURE, 0, "calloc didn't fail on overflow");
+
+  errno = 0;
+  if (calloc(2, half) != NULL || errno != ENOMEM)
+    error(EXIT_FAILURE, 0, "calloc didn't fail on overflow");
+
+  return 0;
+}
+
+/* Blocks freed after being written to must be cleared when reused */
+TEST(calloc_dirty) {
+  static const size_t sizes[] = {24, 100, 1000, 10000, 100000, 300000};
+
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    size_t size = sizes[k];
+    char *ptrs[8];
+
+    for (int i = 0; i < 8; i++) {
+      ptrs[i] = malloc(size);
+      memset(ptrs[i], 0xff, malloc_usable_size(ptrs[i]));
+    }
+    for (int i = 0; i < 8; i++)
+      free(ptrs[i]);
+
+    for (int i = 0; i < 8; i++) {
+      ptrs[i] = calloc(1, size);
+      for (size_t j = 0; j < size; j++)
+        if (ptrs[i][j] != '\0')
+          error(EXIT_FAILURE, 0, "byte not cleared (size %zu, byte %zu)", size, j);
+      memset(ptrs[i], 0xff, size);
+    }
+    for (int i = 0; i < 8; i++)
+      free(ptrs[i]);
+  }
+
+  return 0;
+}
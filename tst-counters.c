@@ -0,0 +1,99 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+/* usable bytes held by calling thread according to its counters */
+static uint64_t live(void) {
+  return thread_allocated_bytes() - thread_deallocated_bytes();
+}
+
+TEST(thread_counters) {
+  uint64_t *allocated = thread_allocated_bytes_ptr();
+  uint64_t *deallocated = thread_deallocated_bytes_ptr();
+  uint64_t before = live();
+  void *p[16];
+  size_t n = 0;
+
+  uint64_t start = *allocated;
+  void *volatile q = malloc(100);
+  size_t size = malloc_usable_size(q);
+  if (*allocated - start != size)
+    merror("malloc wasn't counted by usable size.");
+  if (*allocated != thread_allocated_bytes())
+    merror("counter pointer doesn't match counter.");
+
+  start = *deallocated;
+  free(q);
+  if (*deallocated - start != size)
+    merror("free wasn't counted by usable size.");
+
+  /* every kind of arena & every way of getting memory */
+  p[n++] = malloc(100);
+  p[n++] = calloc(10, 10);
+  p[n++] = memalign(64, 100);
+  p[n++] = valloc(5000);
+  p[n++] = malloc(1 << 20);
+  p[n++] = realloc(malloc(40), 300);
+  p[n++] = realloc(malloc(40), 1 << 20);
+  p[n++] = malloc(200);
+  xallocx(p[n - 1], 400, 0, 0);
+  n += malloc_batch(40, 8, p + n);
+
+  uint64_t usable = 0;
+  for (size_t i = 0; i < n; i++)
+    usable += malloc_usable_size(p[i]);
+  if (live() - before != usable)
+    merror("counters don't add up to usable size of live allocations.");
+
+  free_batch(p + 8, n - 8);
+  for (size_t i = 0; i < 8; i++)
+    free(p[i]);
+  if (live() != before)
+    merror("counters don't add up after everything was freed.");
+
+  return errors != 0;
+}
+
+static void *counters_worker(void *arg) {
+  uint64_t *counters = arg;
+
+  counters[0] = thread_allocated_bytes();
+  void *volatile p = malloc(1 << 20);
+  free(p);
+  counters[1] = thread_allocated_bytes();
+  counters[2] = thread_deallocated_bytes();
+
+  return NULL;
+}
+
+/* Every thread counts only what it did itself */
+TEST(thread_counters_threads) {
+  uint64_t start = thread_allocated_bytes();
+  uint64_t worker[3] = {1};
+  pthread_t thread;
+
+  pthread_create(&thread, NULL, counters_worker, worker);
+  pthread_join(thread, NULL);
+
+  if (worker[0] != 0)
+    merror("counters of new thread don't start at zero.");
+  if (worker[1] - worker[0] < 1 << 20 || worker[2] < 1 << 20)
+    merror("allocations of new thread weren't counted.");
+
+  /* pthread_create may allocate a bit, but not what worker did */
+  if (thread_allocated_bytes() - start >= 1 << 20)
+    merror("allocations of other thread were counted.");
+
+  return errors != 0;
+}
@@ -0,0 +1,110 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 20000
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+static void *ptrs[N];
+
+TEST(heap) {
+  heap_t *heap = heap_create();
+
+  if (heap == NULL)
+    merror("heap_create failed.");
+
+  for (int i = 0; i < N; i++) {
+    size_t size = 1 + random() % 1000;
+    if ((ptrs[i] = heap_malloc(heap, size)) == NULL)
+      merror("heap_malloc failed.");
+    else
+      memset(ptrs[i], 0xff, size);
+  }
+
+  /* free every other one, the rest goes away with heap */
+  for (int i = 0; i < N; i += 2)
+    heap_free(heap, ptrs[i]);
+
+  void *big = heap_malloc(heap, 1024 * 1024);
+  if (big == NULL)
+    merror("heap_malloc (1M) failed.");
+  memset(big, 0xff, 1024 * 1024);
+
+  errno = 0;
+  if (heap_malloc(heap, -1) != NULL || errno != ENOMEM)
+    merror("heap_malloc (-1) succeeded.");
+
+  heap_destroy(heap);
+
+  return errors != 0;
+}
+
+TEST(heap_separate) {
+  heap_t *a = heap_create();
+  heap_t *b = heap_create();
+
+  void *p = heap_malloc(a, 100);
+  void *q = heap_malloc(b, 100);
+  void *r = malloc(100);
+
+  if (p == NULL || q == NULL || r == NULL)
+    merror("allocation failed.");
+
+  heap_destroy(a);
+
+  /* other heap and global allocator are not affected */
+  memset(q, 0xff, 100);
+  memset(r, 0xff, 100);
+  heap_free(b, q);
+  free(r);
+
+  heap_destroy(b);
+
+  return errors != 0;
+}
+
+#define THREADS 64
+
+static void *heap_worker(void *arg) {
+  heap_t *heap = arg;
+  /* blocks stay allocated, freeing them could hide new arenas */
+  for (int i = 0; i < 100; i++)
+    heap_malloc(heap, 16 + i % 64);
+  return NULL;
+}
+
+/* Short-lived threads keep using the same heap arenas */
+TEST(heap_threads) {
+  struct malloc_heap_report report;
+  heap_t *heap = heap_create();
+  pthread_t thread;
+
+  heap_free(heap, heap_malloc(heap, 16));
+
+  malloc_heap_report(&report);
+  size_t before = report.limit_mapped_bytes;
+
+  for (int i = 0; i < THREADS; i++) {
+    pthread_create(&thread, NULL, heap_worker, heap);
+    pthread_join(thread, NULL);
+  }
+
+  malloc_heap_report(&report);
+  if (report.limit_mapped_bytes - before >= (THREADS / 4) * 512 * 1024)
+    merror("every thread mapped new heap arena.");
+
+  heap_destroy(heap);
+
+  return errors != 0;
+}
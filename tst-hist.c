@@ -0,0 +1,64 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NBUCKETS 512
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+/* Number of samples recorded for 'op', 0 without histograms */
+static uint64_t samples(int op) {
+  uint64_t counts[NBUCKETS], bounds[NBUCKETS], total = 0;
+  size_t n = malloc_latency_histogram(op, counts, bounds, NBUCKETS);
+
+  for (size_t i = 0; i < n; i++) {
+    total += counts[i];
+    if (i > 0 && bounds[i] <= bounds[i - 1])
+      merror("bucket bounds are not increasing.");
+  }
+
+  return total;
+}
+
+TEST(latency_histogram) {
+  uint64_t counts[NBUCKETS], bounds[NBUCKETS];
+  uint64_t memalign = samples(MALLOC_LAT_MEMALIGN);
+  uint64_t freed = samples(MALLOC_LAT_FREE);
+  uint64_t calloced = samples(MALLOC_LAT_CALLOC);
+  uint64_t lock_wait = samples(MALLOC_LAT_LOCK_WAIT);
+
+  for (int i = 0; i < 1000; i++) {
+    void *volatile p = malloc(100);
+    free(p);
+  }
+
+  void *volatile z = calloc(10, 10);
+  free(z);
+
+  /* malloc.so built without histograms */
+  if (malloc_latency_histogram(MALLOC_LAT_MEMALIGN, counts, bounds, NBUCKETS) == 0)
+    return 0;
+
+  if (samples(MALLOC_LAT_MEMALIGN) - memalign < 1000)
+    merror("memalign histogram missed some calls.");
+  if (samples(MALLOC_LAT_FREE) - freed < 1000)
+    merror("free histogram missed some calls.");
+  if (samples(MALLOC_LAT_MEMALIGN) - memalign > 1000)
+    merror("calloc was counted as memalign.");
+  if (samples(MALLOC_LAT_CALLOC) - calloced != 1)
+    merror("calloc histogram missed its call.");
+  /* every malloc & free takes the lock at least once */
+  if (samples(MALLOC_LAT_LOCK_WAIT) - lock_wait < 2000)
+    merror("lock wait histogram missed some calls.");
+
+  if (malloc_latency_histogram(MALLOC_LAT_NOPS, counts, bounds, NBUCKETS) != 0)
+    merror("histogram of invalid operation returned.");
+
+  return errors != 0;
+}
@@ -0,0 +1,155 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+#define MiB (1 << 20)
+
+/* Bytes counted against the limit right now */
+static size_t mapped(void) {
+  struct malloc_heap_report report;
+  malloc_heap_report(&report);
+  return report.limit_mapped_bytes;
+}
+
+/* Sets limit to what's mapped now plus 'headroom' bytes */
+static void limit(size_t headroom) {
+  malloc_set_heap_limit(0);
+  malloc_set_heap_limit(mapped() + headroom);
+}
+
+TEST(heap_limit) {
+  struct malloc_heap_report report;
+
+  limit(4 * MiB);
+
+  void *small = malloc(100);
+  void *fits = malloc(MiB);
+  if (small == NULL || fits == NULL)
+    merror("allocation under the limit failed.");
+
+  errno = 0;
+  if (malloc(8 * MiB) != NULL || errno != ENOMEM)
+    merror("allocation over the limit didn't fail with ENOMEM.");
+  if (calloc(1, 8 * MiB) != NULL || realloc(fits, 8 * MiB) != NULL)
+    merror("calloc or realloc over the limit didn't fail.");
+  if (malloc_usable_size(fits) < MiB)
+    merror("failed realloc changed the allocation.");
+
+  malloc_heap_report(&report);
+  if (report.limit_failures != 3)
+    merror("failures over the limit weren't counted.");
+  if (report.limit_mapped_bytes > report.limit_bytes)
+    merror("more is mapped than limit allows.");
+
+  /* memory given back makes room again */
+  free(fits);
+  if ((fits = malloc(3 * MiB)) == NULL)
+    merror("unmapped memory wasn't taken off the limit.");
+
+  free(fits);
+  free(small);
+  malloc_set_heap_limit(0);
+
+  return errors != 0;
+}
+
+/* Limit is hit because of cached mapping, which trim gets rid of */
+TEST(heap_limit_trim) {
+  void *volatile cached = malloc(3 * MiB);
+
+  malloc_set_purge_decay(60 * 1000);
+  free(cached);
+  limit(MiB);
+
+  void *ptr = malloc(3 * MiB + MiB / 2);
+  if (ptr == NULL)
+    merror("cached mappings weren't trimmed to make room.");
+
+  free(ptr);
+  malloc_set_heap_limit(0);
+  malloc_set_purge_decay(0);
+
+  return errors != 0;
+}
+
+static void *spare;
+static size_t pressure_size;
+static int pressure_calls;
+
+static void pressure(size_t size, void *arg) {
+  pressure_calls++;
+  pressure_size = size;
+  free(*(void **)arg);
+  *(void **)arg = NULL;
+  /* allocation over the limit from callback doesn't call it again */
+  if (malloc(64 * MiB) != NULL)
+    merror("callback allocated over the limit.");
+}
+
+TEST(heap_limit_pressure) {
+  spare = malloc(4 * MiB);
+  limit(MiB);
+  malloc_set_pressure_callback(pressure, &spare);
+
+  void *ptr = malloc(2 * MiB);
+  if (ptr == NULL)
+    merror("memory freed by pressure callback wasn't used.");
+  if (pressure_calls != 1 || pressure_size != 2 * MiB)
+    merror("pressure callback wasn't called once with request size.");
+
+  /* nothing to spare anymore */
+  errno = 0;
+  if (malloc(8 * MiB) != NULL || errno != ENOMEM)
+    merror("allocation didn't fail when callback couldn't help.");
+  if (pressure_calls != 2)
+    merror("pressure callback wasn't called on second failure.");
+
+  free(ptr);
+  malloc_set_pressure_callback(NULL, NULL);
+  malloc_set_heap_limit(0);
+
+  return errors != 0;
+}
+
+/* Warm pools are unmapped to make room, and not refilled past the limit */
+TEST(heap_limit_warm) {
+  struct malloc_heap_report report;
+  struct timespec delay = {.tv_nsec = 10 * 1000 * 1000};
+
+  malloc_set_prefault(0, 4);
+  for (int i = 0; i < 100; i++) {
+    malloc_heap_report(&report);
+    if (report.warm_bytes == 2 * MiB)
+      break;
+    nanosleep(&delay, NULL);
+  }
+  if (report.warm_bytes != 2 * MiB)
+    merror("warm pool wasn't filled.");
+  limit(MiB);
+
+  void *ptr = malloc(2 * MiB + MiB / 2);
+  if (ptr == NULL)
+    merror("warm pools weren't emptied to make room.");
+
+  nanosleep(&delay, NULL);
+  malloc_heap_report(&report);
+  if (report.warm_bytes != 0)
+    merror("warm pool was refilled with no room left under the limit.");
+
+  free(ptr);
+  malloc_set_heap_limit(0);
+  malloc_set_prefault(0, 0);
+
+  return errors != 0;
+}
@@ -17,9 +17,15 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "test.h"
+#include "malloc_ext.h"
 #include <errno.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static int errors = 0;
 
@@ -73,3 +79,276 @@ TEST(malloc) {
 
   return errors != 0;
 }
+
+/*
+ * Allocated blocks have no footer, their last 8 usable bytes live where
+ * the footer used to be. Filling them must not confuse coalescing.
+ */
+TEST(malloc_usable_tail) {
+  static unsigned char *p[512];
+
+  for (int i = 0; i < 512; i++) {
+    size_t size = 24 + 8 * (i % 16);
+    p[i] = malloc(size);
+    /* footer's place is given to data, so these fit exactly */
+    if (size % 16 == 8 && malloc_usable_size(p[i]) != size)
+      merror("usable size wastes space for footer.");
+    memset(p[i], 0xff, malloc_usable_size(p[i]));
+  }
+
+  /* free every other block, then the rest, so each one coalesces */
+  for (int i = 0; i < 512; i += 2)
+    free(p[i]);
+  for (int i = 1; i < 512; i += 2)
+    free(p[i]);
+
+  void *q = malloc(64 * 1024);
+  if (q == NULL)
+    merror("malloc (64K) after freeing everything failed.");
+  free(q);
+
+  return errors != 0;
+}
+
+/*
+ * Small blocks freed to quick bins are reused first, but stay free memory:
+ * growing a block in place or a big request must still get their space.
+ */
+TEST(malloc_quick) {
+  struct malloc_heap_report before, after;
+  static void *p[16];
+
+  /* volatile, so that compiler doesn't optimize malloc & free pairs away */
+  void *volatile a = malloc(40);
+  free(a);
+  void *volatile b = malloc(40);
+  if (b != a)
+    merror("freed block of the same size wasn't reused.");
+
+  b = malloc(40);
+  free(b);
+  if (xallocx(a, 80, 0, 0) < 80)
+    merror("block didn't grow into its quick neighbour.");
+
+  /* blocks next to each other, then whatever is left in the arena */
+  for (int i = 0; i < 16; i++)
+    p[i] = malloc(64);
+  malloc_heap_report(&before);
+  void *volatile rest = malloc(before.largest_free);
+
+  /* none is free really until they're coalesced */
+  for (int i = 0; i < 16; i++)
+    free(p[i]);
+  void *volatile c = malloc(512);
+  malloc_heap_report(&after);
+  if (after.small_arenas != before.small_arenas)
+    merror("quick blocks weren't coalesced before mapping new arena.");
+
+  free(c);
+  free(rest);
+  free(a);
+
+  return errors != 0;
+}
+
+#define LINES_OBJECTS 64
+#define LINES_FILL 4096
+
+static pthread_barrier_t lines_barrier;
+static void *lines_objects[2][LINES_OBJECTS];
+static void *lines_fill[LINES_FILL];
+static void *lines_big;
+static bool lines_borrow;
+
+/*
+ * Fills arena of calling thread, so that it borrows from arena of another
+ * thread from now on. First object that lies outside of it is borrowed.
+ */
+static void lines_fill_arena(void) {
+  struct malloc_heap_report before, after;
+  char *big = lines_big = malloc(500 << 10);
+  int i;
+
+  malloc_heap_report(&before);
+  for (i = 0; i < LINES_FILL; i++) {
+    char *p = lines_fill[i] = malloc(32);
+    if (p < big || p >= big + (512 << 10))
+      break;
+  }
+  malloc_heap_report(&after);
+
+  if (i == LINES_FILL)
+    merror("arena wasn't filled.");
+  if (after.limit_mapped_bytes != before.limit_mapped_bytes)
+    merror("thread mapped new arena instead of borrowing.");
+}
+
+/* Threads take turns, so their objects would be adjacent in shared arena */
+static void *lines_worker(void *arg) {
+  void **objects = lines_objects[(uintptr_t)arg];
+
+  if (lines_borrow && (uintptr_t)arg == 1)
+    lines_fill_arena();
+
+  for (int i = 0; i < LINES_OBJECTS; i++) {
+    pthread_barrier_wait(&lines_barrier);
+    objects[i] = (i % 2) ? memalign(32, 16) : malloc(8 + i % 24);
+    pthread_barrier_wait(&lines_barrier);
+  }
+
+  return NULL;
+}
+
+/* Do usable bytes of 'p' & 'q' touch the same cache line? */
+static bool lines_shared(void *p, void *q) {
+  uintptr_t a = (uintptr_t)p, a_last = a + malloc_usable_size(p) - 1;
+  uintptr_t b = (uintptr_t)q, b_last = b + malloc_usable_size(q) - 1;
+
+  return a / 64 <= b_last / 64 && b / 64 <= a_last / 64;
+}
+
+static void lines_run(bool borrow) {
+  pthread_t thread;
+
+  lines_borrow = borrow;
+  pthread_barrier_init(&lines_barrier, NULL, 2);
+  pthread_create(&thread, NULL, lines_worker, (void *)1);
+  lines_worker((void *)0);
+  pthread_join(thread, NULL);
+  pthread_barrier_destroy(&lines_barrier);
+
+  for (int i = 0; i < LINES_OBJECTS; i++)
+    for (int j = 0; j < LINES_OBJECTS; j++)
+      if (lines_shared(lines_objects[0][i], lines_objects[1][j]))
+        merror("objects of two threads share a cache line.");
+
+  for (int i = 0; i < LINES_OBJECTS; i++) {
+    free(lines_objects[0][i]);
+    free(lines_objects[1][i]);
+  }
+
+  for (int i = 0; i < LINES_FILL; i++)
+    free(lines_fill[i]);
+  free(lines_big);
+  memset(lines_fill, 0, sizeof(lines_fill));
+  lines_big = NULL;
+}
+
+/* Small objects of different threads never share a cache line */
+TEST(malloc_threads) {
+  lines_run(false);
+  return errors != 0;
+}
+
+/* Neither do ones borrowed from arena of another thread */
+TEST(malloc_threads_borrow) {
+  lines_run(true);
+  return errors != 0;
+}
+
+static void *keep_worker(void *arg) {
+  *(void **)arg = malloc(16);
+  return NULL;
+}
+
+/*
+ * Request filling almost whole arena can't be borrowed from another thread,
+ * so it gets new arena without being rounded out to cache lines.
+ */
+TEST(malloc_threads_large) {
+  void *volatile mine = malloc(16);
+  void *theirs;
+  pthread_t thread;
+
+  pthread_create(&thread, NULL, keep_worker, &theirs);
+  pthread_join(thread, NULL);
+
+  for (size_t size = 511 << 10; size < 512 << 10; size += 8) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+      merror("large small allocation failed.");
+      break;
+    }
+    memset(ptr, 1, size);
+    free(ptr);
+  }
+
+  free(theirs);
+  free(mine);
+
+  return errors != 0;
+}
+
+static size_t exit_free_blocks;
+
+static void *exit_worker(void *arg) {
+  struct malloc_heap_report report;
+  void **kept = arg;
+
+  /* one object outlives the thread, the rest sits in quick bins */
+  *kept = malloc(48);
+  for (int i = 0; i < 16; i++) {
+    void *volatile p = malloc(16 * (i % 8 + 1));
+    free(p);
+  }
+  void *volatile q = memalign(32, 16);
+  free(q);
+
+  malloc_heap_report(&report);
+  exit_free_blocks = report.free_blocks;
+
+  return NULL;
+}
+
+/* Arenas of exited threads are adopted by new ones, not mapped again */
+TEST(malloc_thread_exit) {
+  struct malloc_heap_report before, after;
+  static void *kept[65];
+  pthread_t thread;
+
+  /* first one maps arenas, for itself & whatever pthread_create needs */
+  pthread_create(&thread, NULL, exit_worker, &kept[64]);
+  pthread_join(thread, NULL);
+  malloc_heap_report(&before);
+
+  for (int i = 0; i < 64; i++) {
+    pthread_create(&thread, NULL, exit_worker, &kept[i]);
+    pthread_join(thread, NULL);
+
+    /* quick blocks of exited thread are coalesced back into free memory */
+    malloc_heap_report(&after);
+    if (after.free_blocks >= exit_free_blocks) {
+      merror("quick bins of exited thread weren't flushed.");
+      break;
+    }
+  }
+
+  malloc_heap_report(&after);
+  if (after.small_arenas != before.small_arenas)
+    merror("small arenas of exited threads weren't adopted.");
+  if (after.aligned_arenas != before.aligned_arenas)
+    merror("aligned arenas of exited threads weren't adopted.");
+
+  for (int i = 0; i < 65; i++)
+    free(kept[i]);
+
+  return errors != 0;
+}
+
+BENCH(malloc_free_32) {
+  for (size_t i = 0; i < iterations; i++) {
+    void *volatile p = malloc(32);
+    free(p);
+  }
+}
+
+/* malloc & free of random sizes up to 1KiB with 256 objects alive */
+BENCH(malloc_free_churn) {
+  static void *slots[256];
+
+  for (size_t i = 0; i < iterations; i++) {
+    size_t k = (i * 7919) % 256;
+    free(slots[k]);
+    slots[k] = malloc(8 + (i * 2654435761u) % 1024);
+  }
+}
@@ -17,9 +17,12 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "test.h"
+#include "malloc_ext.h"
 #include <errno.h>
 #include <malloc.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -108,3 +111,123 @@ TEST(memalign) {
 
   return errors != 0;
 }
+
+/*
+ * Cache line & SIMD aligned requests are served from slots of aligned size
+ * classes, never splitting padding blocks. Freed slot is reused right away.
+ */
+TEST(memalign_slots) {
+  struct malloc_heap_report before, after;
+  size_t alignments[] = {32, 64, 128, 256};
+  void *p[4][64];
+
+  malloc_heap_report(&before);
+
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 64; j++) {
+      size_t size = 1 + j * 31;
+      p[i][j] = memalign(alignments[i], size);
+      if (p[i][j] == NULL || (uintptr_t)p[i][j] % alignments[i] != 0)
+        merror("aligned allocation failed.");
+      if (malloc_usable_size(p[i][j]) < size)
+        merror("usable size is smaller than requested.");
+      memset(p[i][j], 0xff, malloc_usable_size(p[i][j]));
+    }
+  }
+
+  malloc_heap_report(&after);
+  if (after.padding_blocks != before.padding_blocks)
+    merror("aligned allocation split padding block.");
+  if (after.aligned_bytes < before.aligned_bytes + 4 * 64 * 31)
+    merror("aligned slots are missing from report.");
+
+  void *volatile q = p[1][10];
+  free(q);
+  if (memalign(64, 300) != q)
+    merror("freed slot wasn't reused.");
+
+  q = realloc(q, 4000);
+  if (q == NULL || malloc_usable_size(q) < 4000)
+    merror("realloc out of slot failed.");
+  p[1][10] = q;
+
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 64; j++)
+      free(p[i][j]);
+
+  malloc_heap_report(&after);
+  if (after.aligned_bytes != before.aligned_bytes)
+    merror("freed slots are still accounted.");
+
+  return errors != 0;
+}
+
+BENCH(memalign_free) {
+  for (size_t i = 0; i < iterations; i++) {
+    void *volatile p = memalign(64 << (i % 4), 100);
+    free(p);
+  }
+}
+
+#define HOLES 2000
+
+static char *holes[HOLES];
+static size_t hole_sizes[HOLES];
+
+/*
+ * Aligned requests too big for slots go to small arenas, where first fit
+ * skips holes that are big enough but can't fit the padding. Arenas are
+ * checked by every heap report of a DEBUG build.
+ */
+TEST(memalign_fragmented) {
+  struct malloc_heap_report report;
+  static const size_t alignments[] = {32, 64, 256, 1024, 2048};
+
+  srandom(1);
+
+  /* every other block is freed, which leaves holes of various sizes */
+  for (int i = 0; i < HOLES; i++) {
+    hole_sizes[i] = 2100 + random() % 6000;
+    holes[i] = malloc(hole_sizes[i]);
+    memset(holes[i], i, hole_sizes[i]);
+  }
+  for (int i = 0; i < HOLES; i += 2) {
+    free(holes[i]);
+    holes[i] = NULL;
+  }
+
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < HOLES; i += 2) {
+      size_t alignment = alignments[random() % 5];
+      size_t size = 2100 + random() % 6000;
+      if (holes[i]) {
+        free(holes[i]);
+        holes[i] = NULL;
+      }
+      else if ((holes[i] = memalign(alignment, size)) == NULL) {
+        merror("memalign failed.");
+      }
+      else {
+        if ((uintptr_t)holes[i] & (alignment - 1))
+          merror("memalign returned misaligned block.");
+        hole_sizes[i] = size;
+        memset(holes[i], i, size);
+      }
+    }
+    malloc_heap_report(&report);
+  }
+
+  for (int i = 0; i < HOLES; i++) {
+    if (holes[i] == NULL)
+      continue;
+    for (size_t j = 0; j < hole_sizes[i]; j++) {
+      if (holes[i][j] != (char)i) {
+        merror("blocks overlap.");
+        break;
+      }
+    }
+    free(holes[i]);
+  }
+
+  return errors != 0;
+}
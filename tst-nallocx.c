@@ -0,0 +1,60 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+static void check(size_t size, size_t alignment) {
+  size_t usable = nallocx(size, MALLOCX_ALIGN(alignment));
+  void *p = memalign(alignment, size);
+
+  if (p == NULL) {
+    merror("memalign failed.");
+    return;
+  }
+
+  if (usable < size)
+    merror("nallocx returned less than requested.");
+
+  if (malloc_usable_size(p) < usable)
+    merror("nallocx promised more than allocation provides.");
+
+  free(p);
+}
+
+TEST(nallocx) {
+  for (size_t size = 1; size < 4096; size += 7)
+    check(size, 16);
+
+  for (size_t size = 1; size < 8 * 1024 * 1024; size = size * 3 + 1) {
+    check(size, 16);
+    check(size, 64);
+    check(size, 4096);
+  }
+
+  if (nallocx(0, 0) != 0)
+    merror("nallocx (0) is not zero.");
+
+  if (nallocx(-1, 0) != 0)
+    merror("nallocx (-1) is not zero.");
+
+  if (malloc_good_size(1000) != nallocx(1000, 0))
+    merror("malloc_good_size differs from nallocx.");
+
+  /* BIG allocations are rounded to page size */
+  size_t usable = malloc_good_size(1024 * 1024 + 1);
+  void *p = malloc(1024 * 1024 + 1);
+  if (malloc_usable_size(p) != usable)
+    merror("malloc_good_size doesn't match usable size of big allocation.");
+  free(p);
+
+  return errors != 0;
+}
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include "test.h"
+#include "malloc_ext.h"
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+#define MiB (1 << 20)
+
+/* Keeps calling thread on CPU it runs on, returns node of that CPU */
+static unsigned pin(void) {
+  unsigned cpu, node;
+  cpu_set_t set;
+
+  if (getcpu(&cpu, &node) < 0)
+    return 0;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+
+  return node;
+}
+
+/* Every mapped & allocated byte is counted on some node */
+TEST(numa_report) {
+  struct malloc_heap_report report;
+  size_t mapped = 0, allocated = 0;
+  unsigned node = pin();
+
+  malloc_heap_report(&report);
+  if (report.numa_nodes < 1 || report.numa_nodes > MALLOC_REPORT_NODES)
+    merror("number of nodes is off.");
+
+  for (size_t i = 0; i < MALLOC_REPORT_NODES; i++) {
+    mapped += report.node_mapped_bytes[i];
+    allocated += report.node_allocated_bytes[i];
+  }
+  if (mapped != report.mapped_bytes || allocated != report.allocated_bytes)
+    merror("bytes of nodes don't add up to totals.");
+
+  size_t before = report.node_allocated_bytes[node];
+  void *volatile big = malloc(MiB);
+  malloc_heap_report(&report);
+  if (report.node_allocated_bytes[node] - before < MiB)
+    merror("allocation wasn't counted on node of calling thread.");
+
+  free(big);
+
+  return errors != 0;
+}
+
+/* Memory is bound to node of calling thread, unless there's just one */
+TEST(numa_bind) {
+  struct malloc_heap_report report;
+  unsigned long mask[MALLOC_REPORT_NODES / 64 + 1] = {0};
+  unsigned node = pin();
+  int mode = -1;
+
+  malloc_heap_report(&report);
+  char *big = malloc(MiB);
+  memset(big, 1, MiB);
+
+  if (syscall(SYS_get_mempolicy, &mode, mask, MALLOC_REPORT_NODES + 1, big,
+              MPOL_F_ADDR) < 0) {
+    merror("get_mempolicy failed.");
+  }
+  else if (report.numa_nodes == 1) {
+    if (mode != MPOL_DEFAULT)
+      merror("memory was bound with single node.");
+  }
+  else if (mode != MPOL_PREFERRED || !(mask[node / 64] & (1UL << node % 64))) {
+    merror("memory wasn't bound to node of calling thread.");
+  }
+
+  free(big);
+
+  return errors != 0;
+}
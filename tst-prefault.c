@@ -0,0 +1,106 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+#define MiB (1 << 20)
+
+/* Number of resident pages among whole pages inside 'size' bytes at 'ptr' */
+static size_t resident(void *ptr, size_t size) {
+  uintptr_t pagesize = getpagesize();
+  uintptr_t start = ((uintptr_t)ptr + pagesize - 1) & -pagesize;
+  uintptr_t end = ((uintptr_t)ptr + size) & -pagesize;
+  static unsigned char vec[4096];
+  size_t n = 0;
+
+  if (end <= start || mincore((void *)start, end - start, vec) < 0)
+    return 0;
+
+  for (size_t i = 0; i < (end - start) / pagesize; i++)
+    n += vec[i] & 1;
+
+  return n;
+}
+
+static size_t pages(size_t size) {
+  return size / getpagesize() - 1;
+}
+
+/* Waits up to a second for warm pool to hold 'bytes' */
+static bool warm(size_t bytes) {
+  struct malloc_heap_report report;
+  struct timespec delay = {.tv_nsec = 10 * 1000 * 1000};
+
+  for (int i = 0; i < 100; i++) {
+    malloc_heap_report(&report);
+    if (report.warm_bytes == bytes)
+      return true;
+    nanosleep(&delay, NULL);
+  }
+
+  return false;
+}
+
+/* Mappings up to the limit are populated, bigger ones aren't */
+TEST(prefault_populate) {
+  malloc_set_prefault(4 * MiB, 0);
+
+  void *big = malloc(2 * MiB);
+  if (resident(big, 2 * MiB) != pages(2 * MiB))
+    merror("big mapping under the limit wasn't populated.");
+
+  void *huge = malloc(8 * MiB);
+  if (resident(huge, 8 * MiB) != 0)
+    merror("big mapping over the limit was populated.");
+
+  /* heap maps new small arena */
+  heap_t *heap = heap_create();
+  void *small = heap_malloc(heap, 100000);
+  if (resident(small, 100000) != pages(100000))
+    merror("new small arena wasn't populated.");
+
+  heap_destroy(heap);
+  free(huge);
+  free(big);
+
+  return errors != 0;
+}
+
+/* New arenas come from warm pool, which is filled up again */
+TEST(prefault_warm) {
+  if (malloc_set_prefault(0, 2) < 0)
+    merror("warm thread didn't start.");
+  if (!warm(2 * (512 << 10)))
+    merror("warm pool wasn't filled.");
+
+  heap_t *heap = heap_create();
+  void *small = heap_malloc(heap, 100000);
+  if (resident(small, 100000) != pages(100000))
+    merror("new arena didn't come from warm pool.");
+  if (!warm(2 * (512 << 10)))
+    merror("warm pool wasn't filled up again.");
+
+  malloc_set_prefault(0, 0);
+  if (!warm(0))
+    merror("warm pool wasn't emptied.");
+
+  heap_destroy(heap);
+
+  if (malloc_set_prefault(0, 1000) == 0)
+    merror("too big warm pool was accepted.");
+
+  return errors != 0;
+}
@@ -0,0 +1,148 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define N 10000
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+static void *ptrs[N];
+
+/* Number of live samples, and how many of them are of 'size' bytes */
+static unsigned long samples(size_t size, unsigned long *sized) {
+  char path[] = "/tmp/tst-prof-XXXXXX";
+  unsigned long objs = 0, bytes, n;
+  char line[256];
+
+  close(mkstemp(path));
+  *sized = 0;
+
+  FILE *f = malloc_prof_dump(path) == 0 ? fopen(path, "r") : NULL;
+  if (f == NULL || fscanf(f, "heap profile: %lu: %lu", &objs, &bytes) != 2)
+    merror("heap profile header is missing.");
+  else
+    while (fgets(line, sizeof(line), f))
+      if (sscanf(line, " 1: %lu [", &n) == 1 && n == size)
+        ++*sized;
+
+  if (f)
+    fclose(f);
+  unlink(path);
+
+  return objs;
+}
+
+static void *first_worker(void *arg) {
+  *(void **)arg = malloc(1 << 20);
+  return NULL;
+}
+
+TEST(prof_dump) {
+  /* profiler is configured at load time, so rerun ourselves with it on */
+  if (getenv("MALLOC_PROF_SAMPLE") == NULL) {
+    if (malloc_prof_dump("/dev/null") == 0 || errno != EINVAL)
+      merror("malloc_prof_dump succeeded with profiler disabled.");
+    setenv("MALLOC_PROF_SAMPLE", "4096", 1);
+    if (fork() == 0) {
+      execl("/proc/self/exe", "test", "-q", "prof_dump", NULL);
+      merror("failed to re-execute test with profiler enabled.");
+      exit(EXIT_FAILURE);
+    }
+    int wstatus;
+    wait(&wstatus);
+    return wstatus != 0 || errors != 0;
+  }
+
+  for (int i = 0; i < N; i++)
+    ptrs[i] = malloc(100);
+
+  for (int i = 0; i < N; i += 2)
+    free(ptrs[i]);
+
+  char path[] = "/tmp/tst-prof-XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+
+  if (malloc_prof_dump(path) != 0)
+    merror("malloc_prof_dump failed.");
+
+  FILE *f = fopen(path, "r");
+  unsigned long objs, bytes;
+  char line[256];
+
+  if (f == NULL || fscanf(f, "heap profile: %lu: %lu", &objs, &bytes) != 2) {
+    merror("heap profile header is missing.");
+  }
+  else {
+    /* 500K of live data sampled every 4K on average */
+    if (objs < 20 || objs > 500)
+      merror("number of samples is way off.");
+
+    /* records add up to header, whatever else got sampled on the way */
+    unsigned long records = 0, sum = 0, n, size;
+    bool maps = false;
+    while (!maps && fgets(line, sizeof(line), f)) {
+      maps = strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+      if (sscanf(line, " %lu: %lu [", &n, &size) == 2) {
+        records += n;
+        sum += size;
+      }
+    }
+    if (records != objs || sum != bytes)
+      merror("sampled bytes don't match sampled objects.");
+    if (!maps)
+      merror("heap profile has no memory map.");
+  }
+
+  if (f)
+    fclose(f);
+  unlink(path);
+
+  /* failed realloc leaves allocation & its sample alone */
+  unsigned long sized, before = samples(100, &sized);
+  for (int i = 1; i < N; i += 2)
+    if (realloc(ptrs[i], SIZE_MAX / 2) != NULL)
+      merror("realloc (SIZE_MAX / 2) succeeded.");
+  if (samples(100, &sized) != before)
+    merror("failed realloc dropped its sample.");
+
+  /* first allocation of a thread is sampled too, 1M is way over interval */
+  void *first;
+  pthread_t thread;
+  pthread_create(&thread, NULL, first_worker, &first);
+  pthread_join(thread, NULL);
+  samples(1 << 20, &sized);
+  if (sized != 1)
+    merror("first allocation of a thread wasn't sampled.");
+  free(first);
+
+  /* destroyed heap takes samples of its allocations with it */
+  heap_t *heap = heap_create();
+  for (int i = 0; i < N; i++)
+    heap_malloc(heap, 200);
+  samples(200, &sized);
+  if (sized == 0)
+    merror("heap allocations weren't sampled.");
+  heap_destroy(heap);
+  samples(200, &sized);
+  if (sized != 0)
+    merror("samples outlived their heap.");
+
+  for (int i = 1; i < N; i += 2)
+    free(ptrs[i]);
+
+  return errors != 0;
+}
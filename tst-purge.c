@@ -0,0 +1,181 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+/*
+ * Number of resident pages among whole pages inside 'size' bytes at 'addr'.
+ * Takes address rather than pointer, as it's asked about freed memory.
+ */
+static size_t resident(uintptr_t addr, size_t size) {
+  uintptr_t pagesize = getpagesize();
+  uintptr_t start = (addr + pagesize - 1) & -pagesize;
+  uintptr_t end = (addr + size) & -pagesize;
+  unsigned char vec[256];
+  size_t n = 0;
+
+  if (end <= start || mincore((void *)start, end - start, vec) < 0)
+    return 0;
+
+  for (size_t i = 0; i < (end - start) / pagesize; i++)
+    n += vec[i] & 1;
+
+  return n;
+}
+
+static void *dirty(size_t size) {
+  void *ptr = malloc(size);
+  memset(ptr, 1, size);
+  return ptr;
+}
+
+/* Waits up to five seconds for cached mappings & free pages at 'addr' to go */
+static void wait_purged(uintptr_t addr, size_t size) {
+  struct malloc_heap_report report;
+  struct timespec delay = {.tv_nsec = 10 * 1000 * 1000};
+
+  for (int i = 0; i < 500; i++) {
+    malloc_heap_report(&report);
+    if (report.cached_bytes == 0 && resident(addr, size) == 0)
+      return;
+    nanosleep(&delay, NULL);
+  }
+}
+
+/* Trim releases free pages right away, even with purging off */
+TEST(purge_trim) {
+  void *small = dirty(100000);
+  void *page = valloc(16 * getpagesize());
+  void *keep = malloc(100);
+  uintptr_t small_addr = (uintptr_t)small, page_addr = (uintptr_t)page;
+  struct malloc_heap_report report;
+
+  memset(page, 1, 16 * getpagesize());
+  free(small);
+  free(page);
+
+  if (resident(small_addr, 100000) == 0
+      || resident(page_addr, 16 * getpagesize()) == 0)
+    merror("freed pages aren't resident before trim.");
+
+  if (malloc_trim(0) != 1)
+    merror("trim didn't release anything.");
+
+  if (resident(small_addr, 100000) != 0)
+    merror("free pages of small arena weren't purged.");
+  if (resident(page_addr, 16 * getpagesize()) != 0)
+    merror("free pages of page arena weren't purged.");
+
+  malloc_heap_report(&report);
+  if (report.purged_bytes < 100000)
+    merror("purged bytes weren't reported.");
+
+  /* purged memory is handed out as usual */
+  void *again = dirty(100000);
+  free(again);
+  free(keep);
+
+  return errors != 0;
+}
+
+/* Purged block sits between live ones & comes back known to be zero */
+TEST(purge_zero) {
+  char *before = dirty(100000);
+  char *block = dirty(100000);
+  char *after = dirty(100000);
+  uintptr_t addr = (uintptr_t)block;
+
+  free(block);
+  malloc_trim(0);
+  if (resident(addr, 100000) != 0)
+    merror("free pages weren't purged.");
+
+  /* calloc doesn't have to clear it, so its pages aren't touched */
+  char *zeroed = calloc(1, 100000);
+  if ((uintptr_t)zeroed != addr)
+    merror("purged block wasn't reused.");
+  if (resident(addr, 100000) != 0)
+    merror("calloc wrote to pages of purged block.");
+  for (size_t i = 0; i < 100000; i++) {
+    if (zeroed[i] != 0) {
+      merror("calloc returned memory that isn't zero.");
+      break;
+    }
+  }
+
+  free(zeroed);
+  free(after);
+  free(before);
+
+  return errors != 0;
+}
+
+/* Big mappings are cached while purging is on, purged after decay time */
+TEST(purge_decay) {
+  struct malloc_heap_report report;
+
+  /* long enough for checks of what's cached not to race with purge thread */
+  if (malloc_set_purge_decay(500) < 0)
+    merror("purge thread didn't start.");
+
+  void *big = dirty(1 << 20);
+  void *small = dirty(100000);
+  void *keep = malloc(100);
+  uintptr_t big_addr = (uintptr_t)big, small_addr = (uintptr_t)small;
+  free(big);
+  free(small);
+
+  malloc_heap_report(&report);
+  if (report.cached_bytes < 1 << 20)
+    merror("freed big mapping wasn't cached.");
+
+  /* size overflowing mapping size neither fails on nor takes cached one */
+  errno = 0;
+  if (malloc(-1) != NULL || errno != ENOMEM)
+    merror("malloc (-1) didn't fail with cached mapping around.");
+  if (memalign(1 << 12, -(1 << 12)) != NULL || errno != ENOMEM)
+    merror("memalign (4096, -4096) didn't fail with cached mapping around.");
+
+  void *reused = malloc(1 << 20);
+  if ((uintptr_t)reused != big_addr)
+    merror("cached big mapping wasn't reused.");
+  if (malloc_usable_size(reused) != nallocx(1 << 20, 0))
+    merror("reused mapping has different usable size than a fresh one.");
+  free(reused);
+
+  wait_purged(small_addr, 100000);
+  malloc_heap_report(&report);
+  if (report.cached_bytes != 0)
+    merror("cached big mapping wasn't purged after decay time.");
+  if (resident(small_addr, 100000) != 0)
+    merror("free pages weren't purged after decay time.");
+
+  /* turning it off unmaps cached mappings right away */
+  void *volatile last = malloc(1 << 20);
+  free(last);
+  malloc_heap_report(&report);
+  if (report.cached_bytes < 1 << 20)
+    merror("freed big mapping wasn't cached.");
+  malloc_set_purge_decay(0);
+  malloc_heap_report(&report);
+  if (report.cached_bytes != 0)
+    merror("cached big mapping wasn't released when purging was turned off.");
+
+  free(keep);
+
+  return errors != 0;
+}
@@ -16,9 +16,11 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "test.h"
+#include "malloc_ext.h"
 #include <errno.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static int errors = 0;
@@ -133,3 +135,60 @@ TEST(realloc) {
 
   return errors != 0;
 }
+
+/*
+ * Growing blocks that cannot expand in place must reuse free blocks of
+ * existing arenas, and freeing block past all free blocks of an arena
+ * must not lose it.
+ */
+TEST(realloc_churn) {
+  unsigned char *p[64] = {NULL};
+  size_t size[64] = {0};
+  struct malloc_heap_report report;
+
+  srand(1);
+
+  for (int i = 0; i < 50000; i++) {
+    int k = rand() % 64;
+    size_t n = rand() % 5000;
+
+    for (size_t j = 0; j < n && j < size[k]; j++)
+      if (p[k][j] != (unsigned char)k) {
+        merror("contents lost by realloc");
+        return 1;
+      }
+
+    if ((p[k] = realloc(p[k], n)) == NULL && n != 0) {
+      merror("realloc failed");
+      return 1;
+    }
+
+    memset(p[k], k, n);
+    size[k] = n;
+  }
+
+  malloc_heap_report(&report);
+  if (report.small_arenas > 2)
+    merror("realloc maps new arenas instead of reusing free blocks");
+
+  for (int k = 0; k < 64; k++)
+    free(p[k]);
+
+  return errors != 0;
+}
+
+/* growing buffer 64 bytes at a time up to 64KiB */
+BENCH(realloc_grow) {
+  char *p = NULL;
+
+  for (size_t i = 0; i < iterations; i++) {
+    size_t size = 64 * (1 + i % 1024);
+    if (size == 64) {
+      free(p);
+      p = NULL;
+    }
+    p = realloc(p, size);
+  }
+
+  free(p);
+}
@@ -0,0 +1,70 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 10000
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+static void *ptrs[N];
+
+TEST(heap_report) {
+  struct malloc_heap_report before, after;
+
+  malloc_heap_report(&before);
+
+  for (int i = 0; i < N; i++)
+    ptrs[i] = malloc(64);
+
+  /* punch holes, which cannot coalesce */
+  for (int i = 0; i < N; i += 2)
+    free(ptrs[i]);
+
+  /* volatile, so that compiler doesn't optimize malloc & free pair away */
+  void *volatile big = malloc(4 * 1024 * 1024);
+
+  malloc_heap_report(&after);
+
+  if (after.big_arenas != before.big_arenas + 1)
+    merror("big arena is missing from report.");
+
+  if (after.free_blocks < before.free_blocks + N / 2 - 1)
+    merror("holes are missing from report.");
+
+  if (after.allocated_bytes < before.allocated_bytes + N / 2 * 64)
+    merror("allocated bytes are missing from report.");
+
+  if (after.fragmentation <= 0.0 || after.fragmentation >= 1.0)
+    merror("fragmentation out of range.");
+
+  size_t blocks = 0, arenas = 0;
+  for (int i = 0; i < MALLOC_REPORT_SIZE_BINS; i++)
+    blocks += after.free_histogram[i];
+  for (int i = 0; i < MALLOC_REPORT_OCCUPANCY_CLASSES; i++)
+    arenas += after.occupancy[i];
+
+  if (blocks != after.free_blocks)
+    merror("free block histogram doesn't add up.");
+  if (arenas != after.small_arenas)
+    merror("occupancy classes don't add up.");
+
+  /* beyond aligned slots & page runs, so it needs padding block */
+  free(memalign(8192, 100));
+  malloc_heap_report(&after);
+  if (after.padding_blocks == 0)
+    merror("padding block wasn't counted.");
+
+  free(big);
+  for (int i = 1; i < N; i += 2)
+    free(ptrs[i]);
+
+  return errors != 0;
+}
@@ -0,0 +1,173 @@
+#include "test.h"
+#include "trace.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define N 100000
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+static void *worker(void *arg) {
+  for (int i = 0; i < N; i++) {
+    /* volatile, so that compiler doesn't optimize malloc & free pair away */
+    void *volatile p = malloc((size_t)arg);
+    free(p);
+  }
+  return NULL;
+}
+
+/* Moves big allocation around, while the other thread maps what it leaves */
+static void *realloc_worker(void *arg) {
+  for (int i = 0; i < N / 100; i++) {
+    void *volatile p = malloc((size_t)arg);
+    p = realloc(p, 2 * (size_t)arg);
+    free(p);
+  }
+  return NULL;
+}
+
+static void *malloc_worker(void *arg) {
+  for (int i = 0; i < N / 100; i++) {
+    void *volatile p = malloc((size_t)arg);
+    free(p);
+  }
+  return NULL;
+}
+
+/*
+ * Slot of 'ptr' in open addressing table of 'n' addresses. Addresses stay
+ * in the table once seen, released ones have their lowest bit set.
+ */
+static uint64_t *slot(uint64_t *ptrs, size_t n, uint64_t ptr) {
+  size_t i = (ptr >> 4) * 0x9e3779b97f4a7c15ULL % n;
+  while (ptrs[i] != 0 && (ptrs[i] & ~1ULL) != ptr)
+    i = (i + 1) % n;
+  return &ptrs[i];
+}
+
+static int cmp_timestamp(const void *a, const void *b) {
+  const trace_event_t *x = a, *y = b;
+  return (x->timestamp > y->timestamp) - (x->timestamp < y->timestamp);
+}
+
+/* In order of timestamps, address is never handed out while still in use */
+static bool replayable(trace_event_t *events, size_t n) {
+  size_t size = 2 * n + 1;
+  uint64_t *ptrs = calloc(size, sizeof(uint64_t));
+  bool ok = true;
+
+  qsort(events, n, sizeof(trace_event_t), cmp_timestamp);
+
+  for (size_t i = 0; i < n && ok; i++) {
+    trace_event_t *event = &events[i];
+    uint64_t released = 0, *s;
+
+    if (event->op == TRACE_FREE)
+      released = event->ptr;
+    else if (event->op == TRACE_REALLOC && (event->ptr || event->size == 0))
+      released = event->arg;
+    if (released && *(s = slot(ptrs, size, released)))
+      *s |= 1;
+
+    if (event->op != TRACE_FREE && event->ptr) {
+      s = slot(ptrs, size, event->ptr);
+      ok = *s != event->ptr;
+      *s = event->ptr;
+    }
+  }
+
+  free(ptrs);
+  return ok;
+}
+
+TEST(trace) {
+  /* tracing is configured at load time, so we trace our child */
+  if (getenv("MALLOC_TRACE_FILE")) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, (void *)24);
+    worker((void *)42);
+    pthread_join(thread, NULL);
+    pthread_create(&thread, NULL, realloc_worker, (void *)(1 << 20));
+    malloc_worker((void *)(1 << 20));
+    pthread_join(thread, NULL);
+    void *volatile p = memalign(64, 100);
+    p = realloc(p, 200);
+    free(p);
+    return 0;
+  }
+
+  char path[] = "/tmp/tst-trace-XXXXXX";
+  close(mkstemp(path));
+
+  pid_t pid;
+  if ((pid = fork()) == 0) {
+    setenv("MALLOC_TRACE_FILE", path, 1);
+    execl("/proc/self/exe", "test", "-q", "trace", NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  int wstatus;
+  waitpid(pid, &wstatus, 0);
+  if (wstatus)
+    merror("traced process failed.");
+
+  FILE *f = fopen(path, "r");
+  trace_header_t header;
+  size_t count[TRACE_MEMALIGN + 1] = {};
+  size_t sizes = 0, n = 0;
+  uint32_t tids[2] = {};
+  struct stat st;
+  trace_event_t *events = NULL;
+
+  if (f == NULL || fread(&header, sizeof(header), 1, f) != 1
+      || header.magic != TRACE_MAGIC || header.record_size != TRACE_RECORD_SIZE) {
+    merror("trace header is broken.");
+  }
+  else {
+    fstat(fileno(f), &st);
+    events = malloc(st.st_size);
+    for (; fread(&events[n], sizeof(trace_event_t), 1, f) == 1; n++) {
+      trace_event_t event = events[n];
+      if (event.op < TRACE_MALLOC || event.op > TRACE_MEMALIGN) {
+        merror("trace has event of unknown kind.");
+        break;
+      }
+      count[event.op]++;
+      if (event.op == TRACE_MALLOC && (event.size == 24 || event.size == 42)) {
+        sizes++;
+        tids[event.size == 24] = event.tid;
+      }
+    }
+
+    if (sizes != 2 * N)
+      merror("malloc events of workers are missing.");
+    if (count[TRACE_FREE] < 2 * N)
+      merror("free events are missing.");
+    if (count[TRACE_MEMALIGN] < 1 || count[TRACE_REALLOC] < 1)
+      merror("memalign or realloc events are missing.");
+    if (tids[0] == tids[1])
+      merror("events of different threads have the same tid.");
+    if (!replayable(events, n))
+      merror("address is handed out again before its release is traced.");
+  }
+
+  if (f)
+    fclose(f);
+  free(events);
+  unlink(path);
+
+  return errors != 0;
+}
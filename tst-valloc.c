@@ -17,8 +17,11 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "test.h"
+#include "malloc_ext.h"
+#include <malloc.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -93,3 +96,49 @@ TEST(valloc) {
 
   return errors != 0;
 }
+
+/*
+ * Page aligned requests are served from runs of pages, without padding
+ * blocks in small arenas, and their memory is accounted separately.
+ */
+TEST(valloc_pages) {
+  struct malloc_heap_report before, after;
+  size_t pagesize = getpagesize();
+  void *p[64];
+
+  malloc_heap_report(&before);
+
+  for (int i = 0; i < 64; i++) {
+    size_t size = 1 + (i % 4) * pagesize + (i * 97) % pagesize;
+    p[i] = (i % 2) ? valloc(size) : memalign(pagesize, size);
+    if (p[i] == NULL || (uintptr_t)p[i] % pagesize != 0)
+      merror("page aligned allocation failed.");
+    if (malloc_usable_size(p[i]) % pagesize != 0)
+      merror("usable size is not multiple of page size.");
+    memset(p[i], 0xff, malloc_usable_size(p[i]));
+  }
+
+  malloc_heap_report(&after);
+  if (after.padding_blocks != before.padding_blocks)
+    merror("page aligned allocation split padding block.");
+  if (after.page_bytes < before.page_bytes + 64 * pagesize)
+    merror("page runs are missing from report.");
+
+  /* run grows in place into pages freed after it */
+  free(p[1]);
+  size_t usable = malloc_usable_size(p[0]);
+  if (xallocx(p[0], usable + pagesize, 0, 0) != usable + pagesize)
+    merror("run didn't grow into free pages.");
+  p[1] = realloc(p[0], 3 * pagesize);
+  if (p[1] == NULL)
+    merror("realloc of page run failed.");
+
+  for (int i = 1; i < 64; i++)
+    free(p[i]);
+
+  malloc_heap_report(&after);
+  if (after.page_bytes != before.page_bytes)
+    merror("freed page runs are still accounted.");
+
+  return errors != 0;
+}
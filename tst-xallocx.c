@@ -0,0 +1,83 @@
+#include "test.h"
+#include "malloc_ext.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int errors = 0;
+
+static void merror(const char *msg) {
+  ++errors;
+  printf("Error: %s\n", msg);
+}
+
+static int check_pattern(unsigned char *p, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != 0xaa)
+      return 0;
+  return 1;
+}
+
+TEST(xallocx_small) {
+  unsigned char *p = malloc(100);
+  unsigned char *q = malloc(100);
+  memset(p, 0xaa, 100);
+
+  /* if following block is taken, it cannot grow */
+  size_t usable = malloc_usable_size(p);
+  if (q == p + usable + 2 * sizeof(size_t) && xallocx(p, 1000, 0, 0) != usable)
+    merror("xallocx grew block followed by allocated one.");
+
+  free(q);
+
+  /* now it can */
+  if (xallocx(p, 1000, 0, 0) < 1000)
+    merror("xallocx (p, 1000) failed to grow.");
+  if (malloc_usable_size(p) < 1000)
+    merror("usable size wasn't updated.");
+  if (!check_pattern(p, 100))
+    merror("xallocx clobbered contents.");
+
+  /* extra is opportunistic */
+  if (try_realloc_inplace(p, 1000, 1 << 30) < 1000)
+    merror("try_realloc_inplace with huge extra failed.");
+
+  if (xallocx(p, 50, 0, 0) < 50)
+    merror("xallocx (p, 50) failed to shrink.");
+  if (!check_pattern(p, 50))
+    merror("shrinking clobbered contents.");
+
+  free(p);
+
+  return errors != 0;
+}
+
+TEST(xallocx_big) {
+  size_t size = 4 * 1024 * 1024;
+  unsigned char *p = malloc(size);
+  memset(p, 0xaa, size);
+
+  size_t usable = xallocx(p, size / 2, 0, 0);
+  if (usable < size / 2 || usable >= size)
+    merror("xallocx failed to shrink big allocation.");
+  if (malloc_usable_size(p) != usable)
+    merror("usable size of big allocation wasn't updated.");
+
+  /* growing may fail if mapping is followed by another one, but never moves */
+  usable = xallocx(p, size, 0, 0);
+  if (usable < size / 2)
+    merror("xallocx lost memory on failed grow.");
+  if (!check_pattern(p, size / 2))
+    merror("xallocx clobbered contents of big allocation.");
+
+  /* size mapping can't grow to leaves allocation as it was */
+  if (xallocx(p, -1, 0, 0) != usable || xallocx(p, size, -1, 0) != usable)
+    merror("xallocx changed big allocation on overflowing size.");
+  if (!check_pattern(p, size / 2))
+    merror("xallocx clobbered contents on overflowing size.");
+
+  free(p);
+
+  return errors != 0;
+}
@@ -1,15 +1,8 @@
 #include "malloc.h"
+#include "hist.h"
 
 #include <malloc.h>
 
-void *calloc(size_t count, size_t size) {
-  size_t bytes = count * size;
-  void *res = malloc(bytes);
-  memset(res, 0, bytes);
-  debug("calloc(%ld, %ld) = %p", count, size, res);
-  return res;
-}
-
 #define MINALIGN sizeof(void *)
 
 int posix_memalign(void **memptr, size_t alignment, size_t bytes) {
@@ -53,18 +46,17 @@ void *pvalloc(size_t bytes) {
   return res;
 }
 
-int malloc_trim(__unused size_t pad) {
-  debug("%s: not implemented!", __func__);
-  return 0;
-}
-
 int mallopt(__unused int param, __unused int value) {
   debug("%s: not implemented!", __func__);
   return 0;
 }
 
 void malloc_stats(void) {
+#ifdef HISTOGRAMS
+  hist_print(STDERR_FILENO);
+#else
   debug("%s: not implemented!", __func__);
+#endif
 }
 
 struct mallinfo mallinfo(void) {